@@ -0,0 +1,105 @@
+// Copyright (C) 2004-2023 Artifex Software, Inc.
+//
+// This file is part of MuPDF WASM Library.
+//
+// MuPDF is free software: you can redistribute it and/or modify it under the
+// terms of the GNU Affero General Public License as published by the Free
+// Software Foundation, either version 3 of the License, or (at your option)
+// any later version.
+//
+// MuPDF is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU Affero General Public License for more
+// details.
+//
+// You should have received a copy of the GNU Affero General Public License
+// along with MuPDF. If not, see <https://www.gnu.org/licenses/agpl-3.0.en.html>
+//
+// Alternative licensing terms are available from the licensor.
+// For commercial licensing, see <https://www.artifex.com/> or contact
+// Artifex Software, Inc., 1305 Grant Avenue - Suite 200, Novato,
+// CA 94945, U.S.A., +1(415)492-9861, for further information.
+
+// Time the pixmap kernels in one or more builds, to compare them:
+//
+//	SIMD=0 DIST=dist-nosimd bash build.sh
+//	node bench/pixmap.js dist-nosimd/mupdf-wasm.js dist/mupdf-wasm.js [file.pdf]
+//
+// With a PDF file, rendering its first page is timed too.
+
+"use strict"
+
+const child_process = require("child_process")
+const fs = require("fs")
+const path = require("path")
+
+const SIZE = 2048
+const RUNS = 20
+
+function time(fn) {
+	fn()
+	let best = Infinity
+	for (let i = 0; i < RUNS; ++i) {
+		let start = process.hrtime.bigint()
+		fn()
+		best = Math.min(best, Number(process.hrtime.bigint() - start) / 1e6)
+	}
+	return best
+}
+
+function bench(file) {
+	const mupdf = require("../src/mupdf.js")
+	return mupdf.ready.then(() => {
+		let results = {}
+		let rgb = new mupdf.Pixmap(mupdf.ColorSpace.DeviceRGB, [ 0, 0, SIZE, SIZE ], false)
+		let rgba = new mupdf.Pixmap(mupdf.ColorSpace.DeviceRGB, [ 0, 0, SIZE, SIZE ], true)
+		let pixels = rgb.getPixels()
+		for (let i = 0; i < pixels.length; ++i)
+			pixels[i] = i * 7 + (i >> 11)
+		rgba.clear(128)
+
+		results["invert"] = time(() => rgb.invert())
+		results["invert luminance"] = time(() => rgb.invertLuminance())
+		results["gamma"] = time(() => rgb.gamma(1.2))
+		results["tint"] = time(() => rgb.tint(0x202040, 0xf0f0e0))
+		results["convert rgb to gray"] = time(() => rgb.convertToColorSpace(mupdf.ColorSpace.DeviceGray).destroy())
+		results["convert rgba to rgb"] = time(() => rgba.convertToColorSpace(mupdf.ColorSpace.DeviceRGB).destroy())
+
+		if (file) {
+			let doc = mupdf.Document.openDocument(fs.readFileSync(file), file)
+			let page = doc.loadPage(0)
+			results["render page"] = time(() => page.toPixmap(mupdf.Matrix.scale(2, 2), mupdf.ColorSpace.DeviceRGB).destroy())
+			results["render page with alpha"] = time(() => page.toPixmap(mupdf.Matrix.scale(2, 2), mupdf.ColorSpace.DeviceRGB, true).destroy())
+		}
+
+		return results
+	})
+}
+
+if (process.env.MUPDF_BENCH_CHILD) {
+	bench(process.argv[2]).then((results) => {
+		process.stdout.write(JSON.stringify(results))
+	})
+} else {
+	let builds = process.argv.slice(2).filter((arg) => arg.endsWith(".js"))
+	let file = process.argv.slice(2).find((arg) => !arg.endsWith(".js"))
+	if (builds.length === 0)
+		builds = [ path.join(__dirname, "../dist/mupdf-wasm.js") ]
+
+	// Each build is loaded in its own process, since the module is a singleton.
+	let table = builds.map((build) => {
+		let env = { ...process.env, MUPDF_BENCH_CHILD: "1", MUPDF_WASM: path.resolve(build) }
+		let args = [ __filename ]
+		if (file)
+			args.push(file)
+		return JSON.parse(child_process.execFileSync(process.execPath, args, { env }).toString())
+	})
+
+	console.log([ "kernel (ms)", ...builds ].join("\t"))
+	for (let kernel of Object.keys(table[0])) {
+		let row = table.map((results) => results[kernel].toFixed(2))
+		if (table.length > 1)
+			row.push((table[0][kernel] / table[table.length - 1][kernel]).toFixed(2) + "x")
+		console.log([ kernel, ...row ].join("\t"))
+	}
+}
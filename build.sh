@@ -2,24 +2,112 @@
 
 EMSDK_DIR=/opt/emsdk
 
+# Maximum number of render threads in the multi-threaded build. The pthread
+# pool has a worker for each but the calling thread, fewer if the program
+# asks for fewer threads in mupdfOptions (see src/mupdf.js).
+THREADS=${THREADS:-16}
+POOL_SIZE="Math.min($THREADS,(globalThis.mupdfOptions||{}).threads||$THREADS)-1"
+
+# Set SIMD=0 to build without WebAssembly SIMD, and DIST to put the results
+# elsewhere; bench/pixmap.js can then compare the two builds.
+SIMD=${SIMD:-1}
+DIST=${DIST:-dist}
+
+# Which variants to build:
+#   release - optimized for speed, with link-time optimization and stripped
+#   mt      - the release build with threads
+#   profile - the release build with function names, for profilers
+#   debug   - unoptimized, with DWARF debug info and runtime assertions
+#   small   - optimized for size, without the base 14 fonts and ICC profiles
+VARIANTS=${VARIANTS:-"release mt profile debug small"}
+
 MUPDF_OPTS="-DTOFU -DTOFU_CJK -DFZ_ENABLE_XPS=0 -DFZ_ENABLE_SVG=0 -DFZ_ENABLE_CBZ=0 -DFZ_ENABLE_IMG=0 -DFZ_ENABLE_HTML=0 -DFZ_ENABLE_EPUB=0 -DFZ_ENABLE_JS=0 -DFZ_ENABLE_OCR_OUTPUT=0 -DFZ_ENABLE_DOCX_OUTPUT=0 -DFZ_ENABLE_ODT_OUTPUT=0"
 
+# The CJK and fallback fonts are already left out above. Documents that
+# embed all their fonts and only use RGB and Gray do not need these either.
+SMALL_OPTS="-DTOFU_BASE14 -DFZ_ENABLE_ICC=0"
+
+SIMD_FLAGS=
+SIMD_SUFFIX=-nosimd
+if [ "$SIMD" != 0 ]; then
+	SIMD_FLAGS=-msimd128
+	SIMD_SUFFIX=
+fi
+
+EMCC_FLAGS=(
+	-sALLOW_MEMORY_GROWTH=1
+	-sMODULARIZE=1
+	-sEXPORT_NAME='"libmupdf"'
+	-sEXPORTED_RUNTIME_METHODS='["ccall","UTF8ToString","lengthBytesUTF8","stringToUTF8"]'
+)
+
 export EMSDK_QUIET=1
 source $EMSDK_DIR/emsdk_env.sh
 echo
 
-echo BUILDING LIBMUPDF
-make -j4 -C libmupdf build=release OS=wasm XCFLAGS="$MUPDF_OPTS" libs
-echo
+mkdir -p $DIST
+REPORT=()
 
-echo BUILDING WASM
-mkdir -p dist
-emcc -o dist/mupdf-wasm.js -Ilibmupdf/include src/wrap.c \
-	-O1 -g \
-	-sALLOW_MEMORY_GROWTH=1 \
-	-sMODULARIZE=1 \
-	-sEXPORT_NAME='"libmupdf"' \
-	-sEXPORTED_RUNTIME_METHODS='["ccall","UTF8ToString","lengthBytesUTF8","stringToUTF8"]' \
-	libmupdf/build/wasm/release/libmupdf.a \
-	libmupdf/build/wasm/release/libmupdf-third.a
-echo
+# build_variant OUTPUT MUPDF_BUILD SUFFIX MUPDF_CFLAGS EMCC_FLAGS...
+#
+# Builds libmupdf (kept apart per variant by the suffix) and links it with
+# the wrapper into $DIST/OUTPUT.js and $DIST/OUTPUT.wasm.
+build_variant() {
+	local output=$1 build=$2 suffix=$3$SIMD_SUFFIX cflags=$4
+	shift 4
+	local start=$SECONDS
+
+	echo BUILDING $output
+	make -j4 -C libmupdf build=$build build_suffix=$suffix OS=wasm XCFLAGS="$cflags" libs || exit 1
+	emcc -o $DIST/$output.js -Ilibmupdf/include src/wrap.c \
+		"$@" \
+		"${EMCC_FLAGS[@]}" \
+		libmupdf/build/wasm/$build$suffix/libmupdf.a \
+		libmupdf/build/wasm/$build$suffix/libmupdf-third.a || exit 1
+	echo
+
+	local size=$(stat -c %s $DIST/$output.wasm)
+	local gzip=$(gzip -9 -c $DIST/$output.wasm | wc -c)
+	# How long the binary takes to compile, as it would when loaded.
+	local compile=$(node -e '
+		const bytes = require("fs").readFileSync(process.argv[1])
+		const start = performance.now()
+		WebAssembly.compile(bytes).then(() => console.log(Math.round(performance.now() - start)))
+	' $DIST/$output.wasm)
+	REPORT+=("$(printf "%-24s %10d %10d %8ds %8dms" $output.wasm $size $gzip $((SECONDS - start)) $compile)")
+}
+
+for variant in $VARIANTS; do
+	case $variant in
+	release)
+		build_variant mupdf-wasm release -lto "$MUPDF_OPTS -O3 -flto $SIMD_FLAGS" \
+			-O3 -flto $SIMD_FLAGS
+		;;
+	mt)
+		build_variant mupdf-wasm-mt release -lto-mt "$MUPDF_OPTS -O3 -flto $SIMD_FLAGS -pthread" \
+			-O3 -flto $SIMD_FLAGS \
+			-pthread \
+			-DWASM_MAX_THREADS=$THREADS \
+			-sPTHREAD_POOL_SIZE="$POOL_SIZE"
+		;;
+	profile)
+		build_variant mupdf-wasm-profile release -lto "$MUPDF_OPTS -O3 -flto $SIMD_FLAGS" \
+			-O3 -flto $SIMD_FLAGS --profiling-funcs
+		;;
+	debug)
+		build_variant mupdf-wasm-debug debug "" "$MUPDF_OPTS $SIMD_FLAGS" \
+			-O0 -g $SIMD_FLAGS -sASSERTIONS=2
+		;;
+	small)
+		build_variant mupdf-wasm-small release -small "$MUPDF_OPTS $SMALL_OPTS -Oz -flto $SIMD_FLAGS" \
+			-Oz -flto $SIMD_FLAGS
+		;;
+	*)
+		echo "unknown variant: $variant"
+		exit 1
+		;;
+	esac
+done
+
+printf "%-24s %10s %10s %9s %10s\n" variant size gzipped build compile
+printf "%s\n" "${REPORT[@]}"
@@ -25,8 +25,9 @@
 var libmupdf
 
 // If running in Node.js environment
+// Set MUPDF_WASM to load another build, such as "../dist/mupdf-wasm-mt.js".
 if (typeof require === "function")
-	libmupdf = require("../dist/mupdf-wasm.js")
+	libmupdf = require(process.env.MUPDF_WASM || "../dist/mupdf-wasm.js")
 
 function checkType(value, type) {
 	if (typeof type === "string" && typeof value !== type)
@@ -73,6 +74,8 @@ let _wasm_quad = 0
 let _wasm_matrix = 0
 let _wasm_color = 0
 let _wasm_string = [ 0, 0 ]
+let _wasm_chars = 0
+let _wasm_chars_max = 0
 
 function STRING_N(s,i) {
 	if (_wasm_string[i]) {
@@ -83,6 +86,19 @@ function STRING_N(s,i) {
 	return _wasm_string[i]
 }
 
+// Fill the char scratch buffer with the chars of a structured text line,
+// growing it as needed, and return how many there are.
+function STEXT_CHARS(line) {
+	let n = libmupdf._wasm_stext_line_get_chars(line, _wasm_chars, _wasm_chars_max)
+	if (n > _wasm_chars_max) {
+		libmupdf._wasm_free(_wasm_chars)
+		_wasm_chars_max = Math.max(n, 256)
+		_wasm_chars = libmupdf._wasm_malloc(_wasm_chars_max * 52)
+		libmupdf._wasm_stext_line_get_chars(line, _wasm_chars, _wasm_chars_max)
+	}
+	return n
+}
+
 function STRING(s) {
 	return STRING_N(s, 0)
 }
@@ -91,6 +107,11 @@ function STRING2(s) {
 	return STRING_N(s, 1)
 }
 
+// The resolution in dpi that a page is rendered at with matrix.
+function matrixResolution(m) {
+	return Math.round(72 * Math.sqrt(Math.abs(m[0] * m[3] - m[1] * m[2])))
+}
+
 function POINT(p) {
 	libmupdf.HEAPF32[_wasm_point + 0] = p[0]
 	libmupdf.HEAPF32[_wasm_point + 1] = p[1]
@@ -113,6 +134,14 @@ function RECT2(r) {
 	return (_wasm_rect + 4) << 2
 }
 
+function IRECT(r) {
+	libmupdf.HEAP32[_wasm_rect + 0] = r[0]
+	libmupdf.HEAP32[_wasm_rect + 1] = r[1]
+	libmupdf.HEAP32[_wasm_rect + 2] = r[2]
+	libmupdf.HEAP32[_wasm_rect + 3] = r[3]
+	return _wasm_rect << 2
+}
+
 function MATRIX(m) {
 	libmupdf.HEAPF32[_wasm_matrix + 0] = m[0]
 	libmupdf.HEAPF32[_wasm_matrix + 1] = m[1]
@@ -141,6 +170,13 @@ function COLOR(c) {
 	return _wasm_color << 2
 }
 
+function COOKIE(cookie) {
+	if (cookie === null || cookie === undefined)
+		return 0
+	checkType(cookie, Cookie)
+	return cookie.pointer
+}
+
 function fromString(ptr) {
 	return libmupdf.UTF8ToString(ptr)
 }
@@ -394,6 +430,240 @@ class Buffer extends Userdata {
 	}
 }
 
+// === Output ===
+
+// Passes what MuPDF writes to a sink, in chunks of chunkSize bytes, so that
+// writing a large file never needs all of it in the wasm heap. The sink has
+//   write(data) - called with a view into the heap that is only valid during
+//     the call, so it must be used or copied at once
+//   close() - optional, called when the output is closed
+//   abort(error) - optional, called instead of close when an operation that
+//     closes the output fails; without it, close is called
+// An error thrown by the sink makes the operation writing to it fail, with
+// the message of the error.
+class Output extends Userdata {
+	static _drop = "_wasm_drop_output"
+
+	constructor(sink, chunkSize = 64 << 10) {
+		let id = ++lastOutputId
+		outputSinks.set(id, { sink, closed: false })
+		let pointer
+		try {
+			pointer = libmupdf._wasm_new_js_output(id, chunkSize)
+		} catch (error) {
+			outputSinks.delete(id)
+			throw error
+		}
+		super(pointer)
+		this.id = id
+	}
+
+	close() {
+		libmupdf._wasm_close_output(this)
+	}
+
+	// Run an operation that writes to the output and closes it. If it fails
+	// the sink is aborted, so that it lets go of what it holds (a file, say).
+	_write(fn) {
+		try {
+			fn()
+		} catch (error) {
+			outputAbort(this.id, error)
+			throw error
+		}
+	}
+
+	// Hand the output over to a writer that drops it itself.
+	_give() {
+		this.constructor._finalizer.unregister(this)
+		let pointer = this.pointer
+		this.pointer = 0
+		return pointer
+	}
+}
+
+const outputSinks = new Map()
+let lastOutputId = 0
+
+// Returns 0, or the message of the error thrown by the sink, in memory that
+// MuPDF frees.
+function outputCall(id, fn) {
+	try {
+		fn(outputSinks.get(id))
+		return 0
+	} catch (error) {
+		return allocateUTF8(error?.message ?? String(error))
+	}
+}
+
+function outputWrite(id, p, n) {
+	return outputCall(id, (entry) => entry.sink.write(libmupdf.HEAPU8.subarray(p, p + n)))
+}
+
+function outputClose(id) {
+	return outputCall(id, (entry) => {
+		entry.sink.close?.()
+		entry.closed = true
+	})
+}
+
+function outputAbort(id, error) {
+	let entry = outputSinks.get(id)
+	if (entry && !entry.closed) {
+		entry.closed = true
+		try {
+			if (entry.sink.abort)
+				entry.sink.abort(error)
+			else
+				entry.sink.close?.()
+		} catch (_) {
+			// The error that made us abort is the one to report.
+		}
+	}
+}
+
+function outputDrop(id) {
+	outputSinks.delete(id)
+}
+
+// Keeps the chunks, outside the wasm heap, to join them when done.
+class ChunkSink {
+	constructor() {
+		this.chunks = []
+		this.length = 0
+	}
+
+	write(data) {
+		this.chunks.push(data.slice())
+		this.length += data.length
+	}
+
+	asUint8Array() {
+		let result = new Uint8Array(this.length)
+		let at = 0
+		for (let chunk of this.chunks) {
+			result.set(chunk, at)
+			at += chunk.length
+		}
+		return result
+	}
+}
+
+// Writes to a file in Node.
+class FileSink {
+	constructor(path) {
+		this.fs = require("fs")
+		this.fd = this.fs.openSync(path, "w")
+	}
+
+	write(data) {
+		for (let at = 0; at < data.length; )
+			at += this.fs.writeSync(this.fd, data, at)
+	}
+
+	close() {
+		this.fs.closeSync(this.fd)
+	}
+}
+
+// Writes to a WritableStream. MuPDF cannot wait for the stream, so chunks
+// are queued in the stream as they come; wait for done after closing, which
+// rejects if any write failed. Once a write has failed the next one throws,
+// which stops the operation writing.
+class WritableStreamSink {
+	constructor(stream) {
+		this.writer = stream.getWriter()
+		this.error = null
+		this.done = Promise.resolve()
+	}
+
+	_track(promise) {
+		promise.catch((error) => {
+			this.error = this.error ?? error
+		})
+		this.done = Promise.all([ this.done, promise ]).then(() => {})
+		this.done.catch(() => {})
+	}
+
+	write(data) {
+		if (this.error)
+			throw this.error
+		this._track(this.writer.write(data.slice()))
+	}
+
+	close() {
+		if (this.error)
+			throw this.error
+		this._track(this.writer.close())
+	}
+
+	abort(error) {
+		this.error = this.error ?? error
+		this._track(this.writer.abort(error).then(() => {
+			throw this.error
+		}))
+	}
+}
+
+class Cookie extends Userdata {
+	static _drop = "_wasm_free_cookie"
+
+	constructor() {
+		super(libmupdf._wasm_new_cookie())
+	}
+
+	abort() {
+		libmupdf._wasm_cookie_set_abort(this, 1)
+	}
+
+	isAborted() {
+		return libmupdf._wasm_cookie_get_abort(this) !== 0
+	}
+
+	// When the wasm memory is shared (threaded build), another worker can
+	// abort the operation with Cookie.abortWithHandle(handle) while it runs.
+	getAbortHandle() {
+		let buffer = libmupdf.HEAPU8.buffer
+		if (typeof SharedArrayBuffer === "undefined" || !(buffer instanceof SharedArrayBuffer))
+			return null
+		// abort is the first field of fz_cookie
+		return { buffer, index: this.pointer >> 2 }
+	}
+
+	static abortWithHandle(handle) {
+		Atomics.store(new Int32Array(handle.buffer), handle.index, 1)
+	}
+
+	// Progress is updated by the interpreter as it goes; progressMax is
+	// zero (or -1) when the total amount of work is not known in advance.
+	getProgress() {
+		return libmupdf._wasm_cookie_get_progress(this)
+	}
+
+	getProgressMax() {
+		return libmupdf._wasm_cookie_get_progress_max(this)
+	}
+
+	getErrors() {
+		return libmupdf._wasm_cookie_get_errors(this)
+	}
+
+	isIncomplete() {
+		return libmupdf._wasm_cookie_get_incomplete(this) !== 0
+	}
+
+	// Read [ progress, progressMax, errors ] through a handle from
+	// getAbortHandle while the operation runs on another thread.
+	static readProgressWithHandle(handle) {
+		let view = new Int32Array(handle.buffer)
+		return [
+			Atomics.load(view, handle.index + 1),
+			Atomics.load(view, handle.index + 2),
+			Atomics.load(view, handle.index + 3),
+		]
+	}
+}
+
 class ColorSpace extends Userdata {
 	static _drop = "_wasm_drop_colorspace"
 	static TYPES = [
@@ -647,6 +917,36 @@ class Text extends Userdata {
 	}
 }
 
+// Returns an array of hits, each an array of quads (one per line it spans).
+function runSearch(searchFn, object, needle, max_hits) {
+	checkType(needle, "string")
+	let hits = 0
+	let marks = 0
+	try {
+		hits = libmupdf._wasm_malloc(32 * max_hits)
+		marks = libmupdf._wasm_malloc(4 * max_hits)
+		let n = searchFn(object, STRING(needle), marks, hits, max_hits)
+		let outer = []
+		if (n > 0) {
+			let inner = []
+			for (let i = 0; i < n; ++i) {
+				let mark = libmupdf.HEAP32[(marks>>2) + i]
+				let quad = fromQuad(hits + i * 32)
+				if (i > 0 && mark) {
+					outer.push(inner)
+					inner = []
+				}
+				inner.push(quad)
+			}
+			outer.push(inner)
+		}
+		return outer
+	} finally {
+		libmupdf._wasm_free(marks)
+		libmupdf._wasm_free(hits)
+	}
+}
+
 class DisplayList extends Userdata {
 	static _drop = "_wasm_drop_display_list"
 
@@ -665,7 +965,26 @@ class DisplayList extends Userdata {
 		return fromRect(libmupdf._wasm_bound_display_list(this))
 	}
 
-	toPixmap(matrix, colorspace, alpha = false) {
+	// See Page.writeBanded.
+	writeBanded(output, format, matrix, colorspace, alpha = false, bandHeight = 256, options = "", cookie = null) {
+		checkType(output, Output)
+		checkMatrix(matrix)
+		checkType(colorspace, ColorSpace)
+		output._write(() => libmupdf._wasm_write_banded_display_list(
+			output,
+			this,
+			MATRIX(matrix),
+			colorspace,
+			alpha,
+			bandHeight,
+			matrixResolution(matrix),
+			STRING(format),
+			STRING2(options),
+			COOKIE(cookie)
+		))
+	}
+
+	toPixmap(matrix, colorspace, alpha = false, cookie = null) {
 		checkMatrix(matrix)
 		checkType(colorspace, ColorSpace)
 		return new Pixmap(
@@ -673,41 +992,182 @@ class DisplayList extends Userdata {
 				this,
 				MATRIX(matrix),
 				colorspace,
-				alpha
+				alpha,
+				COOKIE(cookie)
+			)
+		)
+	}
+
+	// Split the pixel bounds into tiles of at most tileSize pixels.
+	// If a visible rectangle is given, the tiles closest to it come first.
+	getTiles(matrix, tileSize = 512, visible = null) {
+		checkMatrix(matrix)
+		let bbox = Rect.transform(this.getBounds(), matrix)
+		let x0 = Math.floor(bbox[0] + 0.001)
+		let y0 = Math.floor(bbox[1] + 0.001)
+		let x1 = Math.ceil(bbox[2] - 0.001)
+		let y1 = Math.ceil(bbox[3] - 0.001)
+		let tiles = []
+		for (let y = y0; y < y1; y += tileSize)
+			for (let x = x0; x < x1; x += tileSize)
+				tiles.push([ x, y, Math.min(x + tileSize, x1), Math.min(y + tileSize, y1) ])
+		if (visible) {
+			checkRect(visible)
+			let cx = (visible[0] + visible[2]) / 2
+			let cy = (visible[1] + visible[3]) / 2
+			let distance = (t) => Math.hypot((t[0] + t[2]) / 2 - cx, (t[1] + t[3]) / 2 - cy)
+			tiles.sort((a, b) => distance(a) - distance(b))
+		}
+		return tiles
+	}
+
+	toPixmapTile(matrix, colorspace, tile, alpha = false, cookie = null) {
+		checkMatrix(matrix)
+		checkType(colorspace, ColorSpace)
+		checkRect(tile)
+		return new Pixmap(
+			libmupdf._wasm_new_pixmap_tile_from_display_list(
+				this,
+				MATRIX(matrix),
+				colorspace,
+				alpha,
+				IRECT(tile),
+				COOKIE(cookie)
 			)
 		)
 	}
 
-	toStructuredText() {
-		return new StructuredText(libmupdf._wasm_new_stext_page_from_display_list(this))
+	// Render tile by tile (several at once when built with threads) and pass
+	// each tile to onTile(pixmap, tile) as soon as it is done. The pixmap is
+	// destroyed when the callback returns, so only a few tiles exist at a time.
+	// Once the cookie is aborted no more tiles are rendered.
+	toPixmapTiled(matrix, colorspace, tileSize, onTile, alpha = false, visible = null, cookie = null) {
+		checkMatrix(matrix)
+		checkType(colorspace, ColorSpace)
+		let tiles = this.getTiles(matrix, tileSize, visible)
+		let batch = mupdf.threadCount
+		let tiles_ptr = 0
+		let out_ptr = 0
+		try {
+			tiles_ptr = libmupdf._wasm_malloc(16 * batch)
+			out_ptr = libmupdf._wasm_malloc(4 * batch)
+			for (let i = 0; i < tiles.length && !cookie?.isAborted(); i += batch) {
+				let n = Math.min(batch, tiles.length - i)
+				for (let k = 0; k < n; ++k)
+					for (let j = 0; j < 4; ++j)
+						libmupdf.HEAP32[(tiles_ptr >> 2) + k * 4 + j] = tiles[i + k][j]
+				libmupdf._wasm_new_pixmap_tiles_from_display_list(this, MATRIX(matrix), colorspace, alpha, tiles_ptr, n, COOKIE(cookie), out_ptr)
+				let pixmaps = []
+				for (let k = 0; k < n; ++k)
+					pixmaps.push(new Pixmap(libmupdf.HEAP32[(out_ptr >> 2) + k]))
+				try {
+					for (let k = 0; k < n; ++k)
+						onTile(pixmaps[k], tiles[i + k])
+				} finally {
+					for (let pixmap of pixmaps)
+						if (pixmap.pointer)
+							pixmap.destroy()
+				}
+			}
+		} finally {
+			libmupdf._wasm_free(out_ptr)
+			libmupdf._wasm_free(tiles_ptr)
+		}
+	}
+
+	toStructuredText(cookie = null) {
+		return new StructuredText(libmupdf._wasm_new_stext_page_from_display_list(this, COOKIE(cookie)))
 	}
 
-	run(device, matrix) {
+	run(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_run_display_list(this, device, MATRIX(matrix))
+		libmupdf._wasm_run_display_list(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	// TODO: search
+	// Render several display lists at once, in parallel when built with
+	// threads. Aborting the cookie stops all of them.
+	static toPixmaps(lists, matrix, colorspace, alpha = false, cookie = null) {
+		checkMatrix(matrix)
+		checkType(colorspace, ColorSpace)
+		let n = lists.length
+		let lists_ptr = 0
+		let out_ptr = 0
+		try {
+			lists_ptr = libmupdf._wasm_malloc(4 * n)
+			out_ptr = libmupdf._wasm_malloc(4 * n)
+			for (let i = 0; i < n; ++i) {
+				checkType(lists[i], DisplayList)
+				libmupdf.HEAP32[(lists_ptr >> 2) + i] = lists[i].pointer
+			}
+			libmupdf._wasm_new_pixmaps_from_display_lists(lists_ptr, n, MATRIX(matrix), colorspace, alpha, COOKIE(cookie), out_ptr)
+			let result = new Array(n)
+			for (let i = 0; i < n; ++i)
+				result[i] = new Pixmap(libmupdf.HEAP32[(out_ptr >> 2) + i])
+			return result
+		} finally {
+			libmupdf._wasm_free(out_ptr)
+			libmupdf._wasm_free(lists_ptr)
+		}
+	}
+
+	search(needle, max_hits = 500) {
+		return runSearch(libmupdf._wasm_search_display_list, this, needle, max_hits)
+	}
+}
+
+// A block of wasm memory for pixmap samples. Pixmaps created with it do not
+// own the memory, so one block can be reused for render after render instead
+// of allocating a new one for each page. Only one pixmap may use it at a time.
+class SampleBuffer {
+	constructor(size = 0) {
+		this.pointer = 0
+		this.size = 0
+		this.reserve(size)
+	}
+
+	reserve(size) {
+		if (size > this.size) {
+			libmupdf._wasm_free(this.pointer)
+			this.pointer = libmupdf._wasm_malloc(size)
+			this.size = size
+		}
+	}
+
+	destroy() {
+		libmupdf._wasm_free(this.pointer)
+		this.pointer = 0
+		this.size = 0
+	}
 }
 
 class Pixmap extends Userdata {
 	static _drop = "_wasm_drop_pixmap"
 
-	constructor(arg1, bbox = null, alpha = false) {
+	constructor(arg1, bbox = null, alpha = false, samples = null) {
 		let pointer = arg1
 		if (arg1 instanceof ColorSpace) {
 			checkRect(bbox)
-			pointer = libmupdf._wasm_new_pixmap_with_bbox(arg1, RECT(bbox), alpha)
+			if (samples) {
+				checkType(samples, SampleBuffer)
+				// Rounding outwards in double precision is never smaller than
+				// the pixel bounds the C side computes from the float rect.
+				let w = Math.ceil(bbox[2]) - Math.floor(bbox[0])
+				let h = Math.ceil(bbox[3]) - Math.floor(bbox[1])
+				samples.reserve(Math.max(0, w * h * (arg1.getNumberOfComponents() + (alpha ? 1 : 0))))
+				pointer = libmupdf._wasm_new_pixmap_with_bbox_and_data(arg1, RECT(bbox), alpha, samples.pointer, samples.size)
+			} else {
+				pointer = libmupdf._wasm_new_pixmap_with_bbox(arg1, RECT(bbox), alpha)
+			}
 		}
 		super(pointer)
 	}
 
 	getBounds() {
-		let x = libmupdf._wasm_pixmap_x(this)
-		let y = libmupdf._wasm_pixmap_y(this)
-		let w = libmupdf._wasm_pixmap_width(this)
-		let h = libmupdf._wasm_pixmap_height(this)
+		let x = libmupdf._wasm_pixmap_get_x(this)
+		let y = libmupdf._wasm_pixmap_get_y(this)
+		let w = libmupdf._wasm_pixmap_get_w(this)
+		let h = libmupdf._wasm_pixmap_get_h(this)
 		return [ x, y, x + w, y + h ]
 	}
 
@@ -755,15 +1215,16 @@ class Pixmap extends Userdata {
 		return null
 	}
 
+	// A view into the wasm heap; it is only valid until the pixmap is
+	// destroyed or the heap grows. Copy it to keep it.
 	getPixels() {
-		let s = libmupdf._wasm_pixmap_stride(this)
-		let h = libmupdf._wasm_pixmap_height(this)
-		let p = libmupdf._wasm_pixmap_samples(this)
+		let s = libmupdf._wasm_pixmap_get_stride(this)
+		let h = libmupdf._wasm_pixmap_get_h(this)
+		let p = libmupdf._wasm_pixmap_get_samples(this)
 		return new Uint8ClampedArray(libmupdf.HEAPU8.buffer, p, s * h)
 	}
 
-	asPNG() {
-		let buf = libmupdf._wasm_new_buffer_from_pixmap_as_png(this)
+	_encode(buf) {
 		try {
 			let data = libmupdf._wasm_buffer_data(buf)
 			let size = libmupdf._wasm_buffer_size(buf)
@@ -773,7 +1234,33 @@ class Pixmap extends Userdata {
 		}
 	}
 
-	// TODO: asJPEG(quality)
+	// MuPDF compresses PNG at the default zlib level, which is not settable.
+	asPNG() {
+		return this._encode(libmupdf._wasm_new_buffer_from_pixmap_as_png(this))
+	}
+
+	// Much faster to encode than PNG, for previews that may be lossy.
+	// Quality is from 0 to 100.
+	asJPEG(quality = 90, invertCMYK = false) {
+		return this._encode(libmupdf._wasm_new_buffer_from_pixmap_as_jpeg(this, quality, invertCMYK))
+	}
+
+	// Uncompressed, so the fastest to write.
+	asPNM() {
+		return this._encode(libmupdf._wasm_new_buffer_from_pixmap_as_pnm(this))
+	}
+
+	asPAM() {
+		return this._encode(libmupdf._wasm_new_buffer_from_pixmap_as_pam(this))
+	}
+
+	// Write as "png", "jpeg" (or "jpg"), "pnm" or "pam" to an Output, which is
+	// closed when done, so the encoded image never has to be in the wasm heap.
+	// Quality and invertCMYK are for JPEG, as in asJPEG.
+	writeToOutput(output, format, quality = 90, invertCMYK = false) {
+		checkType(output, Output)
+		output._write(() => libmupdf._wasm_write_pixmap(output, this, STRING(format), quality, invertCMYK))
+	}
 
 	invert() {
 		libmupdf._wasm_invert_pixmap(this)
@@ -787,6 +1274,11 @@ class Pixmap extends Userdata {
 		libmupdf._wasm_gamma_pixmap(this, p)
 	}
 
+	convertToColorSpace(colorspace, keepAlpha = false) {
+		checkType(colorspace, ColorSpace)
+		return new Pixmap(libmupdf._wasm_convert_pixmap(this, colorspace, keepAlpha))
+	}
+
 	tint(black, white) {
 		if (black instanceof Array)
 			black = ( ( (black[0] * 255) << 16 ) | ( (black[1] * 255) << 8 ) | ( (black[2] * 255) ) )
@@ -813,13 +1305,18 @@ class StructuredText extends Userdata {
 	static SELECT_WORDS = 1
 	static SELECT_LINES = 2
 
+	static BLOCK_TEXT = 0
+	static BLOCK_IMAGE = 1
+
 	walk(walker) {
+		// One Font object per font on the page, not one per char.
+		let fonts = new Map()
 		let block = libmupdf._wasm_stext_page_get_first_block(this)
 		while (block) {
 			let block_type = libmupdf._wasm_stext_block_get_type(block)
 			let block_bbox = fromRect(libmupdf._wasm_stext_block_get_bbox(block))
 
-			if (block_type === 1) {
+			if (block_type === StructuredText.BLOCK_IMAGE) {
 				if (walker.onImageBlock) {
 					let matrix = fromMatrix(libmupdf._wasm_stext_block_get_transform(block))
 					let image = new Image(libmupdf._wasm_stext_block_get_image(block))
@@ -838,17 +1335,24 @@ class StructuredText extends Userdata {
 						walker.beginLine(line_bbox, line_wmode)
 
 					if (walker.onChar) {
-						let ch = libmupdf._wasm_stext_line_get_first_char(line)
-						while (ch) {
-							let ch_rune = String.fromCharCode(libmupdf._wasm_stext_char_get_c(ch))
-							let ch_origin = fromPoint(libmupdf._wasm_stext_char_get_origin(ch))
-							let ch_font = new Font(libmupdf._wasm_stext_char_get_font(ch))
-							let ch_size = libmupdf._wasm_stext_char_get_size(ch)
-							let ch_quad = fromQuad(libmupdf._wasm_stext_char_get_quad(ch))
+						// Copy the line out of the scratch buffer, since the
+						// callbacks may walk another page and reuse it.
+						let n = STEXT_CHARS(line)
+						let words = libmupdf.HEAPU8.slice(_wasm_chars, _wasm_chars + n * 52).buffer
+						let chars = new Uint32Array(words)
+						let floats = new Float32Array(words)
+						for (let i = 0, k = 0; i < n; ++i, k += 13) {
+							let ch_rune = String.fromCharCode(chars[k])
+							let ch_origin = [ floats[k + 1], floats[k + 2] ]
+							let ch_quad = Array.from(floats.subarray(k + 3, k + 11))
+							let ch_size = floats[k + 11]
+							let ch_font = fonts.get(chars[k + 12])
+							if (!ch_font) {
+								ch_font = new Font(chars[k + 12])
+								fonts.set(chars[k + 12], ch_font)
+							}
 
 							walker.onChar(ch_rune, ch_origin, ch_font, ch_size, ch_quad)
-
-							ch = libmupdf._wasm_stext_char_get_next(ch)
 						}
 					}
 
@@ -870,9 +1374,310 @@ class StructuredText extends Userdata {
 		return fromStringFree(libmupdf._wasm_print_stext_page_as_json(this, scale))
 	}
 
+	// The whole page in one compact binary copy; see StructuredText.fromBinary.
+	asBinary() {
+		let buf = libmupdf._wasm_new_buffer_from_stext_page(this)
+		try {
+			let data = libmupdf._wasm_buffer_data(buf)
+			let size = libmupdf._wasm_buffer_size(buf)
+			return StructuredText.fromBinary(libmupdf.HEAPU8.slice(data, data + size).buffer)
+		} finally {
+			libmupdf._wasm_drop_buffer(buf)
+		}
+	}
+
+	static FONT_BOLD = 1
+	static FONT_ITALIC = 2
+	static FONT_SERIF = 4
+	static FONT_MONO = 8
+
+	// Typed array views over the binary layout written by asBinary. They
+	// all share one ArrayBuffer, so the result can be posted to another
+	// thread with [ result.buffer ] as the transfer list.
+	// Block i has lines blockLines[2*i] up to blockLines[2*i] + blockLines[2*i+1],
+	// and likewise for the chars of each line; fonts are indexes into fontNames.
+	// Block types are the BLOCK_* constants, and font flags the FONT_* bits.
+	static fromBinary(buffer) {
+		let header = new Uint32Array(buffer, 0, 5)
+		let [ nb, nl, nc, nf, names ] = header
+		let offset = 20
+		function u32(n) {
+			let view = new Uint32Array(buffer, offset, n)
+			offset += n * 4
+			return view
+		}
+		function f32(n) {
+			let view = new Float32Array(buffer, offset, n)
+			offset += n * 4
+			return view
+		}
+		let result = {
+			buffer,
+			blockType: u32(nb),
+			blockBBox: f32(nb * 4),
+			blockLines: u32(nb * 2),
+			lineWMode: u32(nl),
+			lineBBox: f32(nl * 4),
+			lineChars: u32(nl * 2),
+			charCode: u32(nc),
+			charOrigin: f32(nc * 2),
+			charQuad: f32(nc * 8),
+			charSize: f32(nc),
+			charFont: u32(nc),
+			fontFlags: u32(nf),
+			fontNames: [],
+		}
+		let fontName = u32(nf * 2)
+		let nameData = new Uint8Array(buffer, offset, names)
+		let decoder = new TextDecoder()
+		for (let i = 0; i < nf; ++i)
+			result.fontNames.push(decoder.decode(nameData.subarray(fontName[i * 2], fontName[i * 2] + fontName[i * 2 + 1])))
+		return result
+	}
+
+	search(needle, max_hits = 500) {
+		return runSearch(libmupdf._wasm_search_stext_page, this, needle, max_hits)
+	}
+
 	// TODO: highlight(a, b) -> quad[]
 	// TODO: copy(a, b) -> string
-	// TODO: search(needle) -> quad[][]
+}
+
+// A word index of the text of a document, built once with
+// Document.createTextIndex and answering queries without extracting text
+// again. Words are runs of letters and digits, matched case-insensitively
+// and whole; a query of several words matches them as a phrase. Each hit
+// has the quads of its words, so highlights do not need the page either.
+//
+// The serialized form is 32-bit words:
+//   header: magic, version, page count, term count, occurrence count, term bytes
+//   terms: UTF-8 offset[nt+1], first occurrence[nt+1], sorted by term
+//   occurrences: page[no], word number in page[no], quad[no][8]
+//   then the UTF-8 bytes of the terms
+class TextIndex {
+	static MAGIC = 0x4954554d
+	static VERSION = 1
+
+	// Load an index from toArrayBuffer or toBuffer. An ArrayBuffer or
+	// Uint8Array is used in place; a Buffer is copied out of the wasm heap
+	// once, since views into the heap do not survive it growing.
+	constructor(data) {
+		if (data instanceof Buffer)
+			data = data.asUint8Array().slice()
+		if (data instanceof Uint8Array) {
+			if (data.byteOffset % 4 !== 0)
+				data = data.slice()
+			this.buffer = data.buffer
+			this.byteOffset = data.byteOffset
+		} else {
+			checkType(data, ArrayBuffer)
+			this.buffer = data
+			this.byteOffset = 0
+		}
+		let offset = this.byteOffset
+		let u32 = (n) => {
+			let view = new Uint32Array(this.buffer, offset, n)
+			offset += n * 4
+			return view
+		}
+		let [ magic, version, pageCount, termCount, occurrenceCount, termBytes ] = u32(6)
+		if (magic !== TextIndex.MAGIC || version !== TextIndex.VERSION)
+			throw new Error("not a text index")
+		this.pageCount = pageCount
+		this.termOffset = u32(termCount + 1)
+		this.termStart = u32(termCount + 1)
+		this.occurrencePage = u32(occurrenceCount)
+		this.occurrenceWord = u32(occurrenceCount)
+		this.occurrenceQuad = new Float32Array(this.buffer, offset, occurrenceCount * 8)
+		offset += occurrenceCount * 32
+		this.termData = new Uint8Array(this.buffer, offset, termBytes)
+		this.byteLength = (offset + termBytes - this.byteOffset + 3) & ~3
+		this._decoder = new TextDecoder()
+		this._terms = new Array(termCount)
+	}
+
+	static tokenize(text) {
+		return text.toLowerCase().match(/[\p{L}\p{N}]+/gu) ?? []
+	}
+
+	// Build from the structured text of every page. 'onPage(index, count)'
+	// is called before each page, for progress reporting.
+	static build(doc, onPage = null) {
+		let terms = new Map()
+		let pageCount = doc.countPages()
+		for (let index = 0; index < pageCount; ++index) {
+			if (onPage)
+				onPage(index, pageCount)
+			let page = doc.loadPage(index)
+			let stext = page.toStructuredText()
+			let text = stext.asBinary()
+			stext.destroy()
+			page.destroy()
+			TextIndex._addPage(terms, index, text)
+		}
+		return TextIndex._serialize(terms, pageCount)
+	}
+
+	static _addPage(terms, page, text) {
+		let { blockType, blockLines, lineChars, charCode, charQuad } = text
+		let word = 0
+		let isWordChar = (c) => /[\p{L}\p{N}]/u.test(String.fromCodePoint(c))
+		for (let b = 0; b < blockType.length; ++b) {
+			let l1 = blockLines[b * 2] + blockLines[b * 2 + 1]
+			for (let l = blockLines[b * 2]; l < l1; ++l) {
+				let c1 = lineChars[l * 2] + lineChars[l * 2 + 1]
+				for (let c = lineChars[l * 2]; c < c1; ) {
+					if (!isWordChar(charCode[c])) {
+						++c
+						continue
+					}
+					let first = c
+					let term = ""
+					while (c < c1 && isWordChar(charCode[c]))
+						term += String.fromCodePoint(charCode[c++])
+					let last = c - 1
+					let quad = [
+						charQuad[first * 8 + 0], charQuad[first * 8 + 1],
+						charQuad[last * 8 + 2], charQuad[last * 8 + 3],
+						charQuad[first * 8 + 4], charQuad[first * 8 + 5],
+						charQuad[last * 8 + 6], charQuad[last * 8 + 7],
+					]
+					term = term.toLowerCase()
+					let list = terms.get(term)
+					if (!list)
+						terms.set(term, list = [])
+					list.push(page, word++, quad)
+				}
+			}
+		}
+	}
+
+	static _serialize(terms, pageCount) {
+		let encoder = new TextEncoder()
+		let sorted = Array.from(terms.keys()).sort()
+		let encoded = sorted.map((term) => encoder.encode(term))
+		let termBytes = encoded.reduce((n, bytes) => n + bytes.length, 0)
+		let occurrenceCount = 0
+		for (let list of terms.values())
+			occurrenceCount += list.length / 3
+		let nt = sorted.length
+		let size = 4 * (6 + (nt + 1) * 2 + occurrenceCount * 10) + termBytes
+		let buffer = new ArrayBuffer((size + 3) & ~3)
+		let header = new Uint32Array(buffer, 0, 6)
+		header.set([ TextIndex.MAGIC, TextIndex.VERSION, pageCount, nt, occurrenceCount, termBytes ])
+		let offset = 24
+		let termOffset = new Uint32Array(buffer, offset, nt + 1)
+		let termStart = new Uint32Array(buffer, offset += (nt + 1) * 4, nt + 1)
+		let occurrencePage = new Uint32Array(buffer, offset += (nt + 1) * 4, occurrenceCount)
+		let occurrenceWord = new Uint32Array(buffer, offset += occurrenceCount * 4, occurrenceCount)
+		let occurrenceQuad = new Float32Array(buffer, offset += occurrenceCount * 4, occurrenceCount * 8)
+		let termData = new Uint8Array(buffer, offset += occurrenceCount * 32, termBytes)
+		let bytes = 0
+		let k = 0
+		for (let i = 0; i < nt; ++i) {
+			termOffset[i] = bytes
+			termStart[i] = k
+			termData.set(encoded[i], bytes)
+			bytes += encoded[i].length
+			let list = terms.get(sorted[i])
+			for (let j = 0; j < list.length; j += 3, ++k) {
+				occurrencePage[k] = list[j]
+				occurrenceWord[k] = list[j + 1]
+				occurrenceQuad.set(list[j + 2], k * 8)
+			}
+		}
+		termOffset[nt] = bytes
+		termStart[nt] = k
+		return new TextIndex(buffer)
+	}
+
+	_term(i) {
+		if (this._terms[i] === undefined)
+			this._terms[i] = this._decoder.decode(this.termData.subarray(this.termOffset[i], this.termOffset[i + 1]))
+		return this._terms[i]
+	}
+
+	_findTerm(term) {
+		let lo = 0
+		let hi = this.termStart.length - 2
+		while (lo <= hi) {
+			let mid = (lo + hi) >> 1
+			let t = this._term(mid)
+			if (t < term)
+				lo = mid + 1
+			else if (t > term)
+				hi = mid - 1
+			else
+				return mid
+		}
+		return -1
+	}
+
+	// Returns an array of { page, hits } in page order, where each hit is an
+	// array of quads, one per word of the query.
+	search(query) {
+		let words = TextIndex.tokenize(query)
+		if (words.length === 0)
+			return []
+		let terms = words.map((word) => this._findTerm(word))
+		if (terms.includes(-1))
+			return []
+
+		// Start from the first word and look for the others after it.
+		let byPage = new Map()
+		for (let k = this.termStart[terms[0]]; k < this.termStart[terms[0] + 1]; ++k) {
+			let page = this.occurrencePage[k]
+			let word = this.occurrenceWord[k]
+			let hit = [ this._quad(k) ]
+			for (let i = 1; i < terms.length; ++i) {
+				let j = this._findOccurrence(terms[i], page, word + i)
+				if (j < 0) {
+					hit = null
+					break
+				}
+				hit.push(this._quad(j))
+			}
+			if (!hit)
+				continue
+			let hits = byPage.get(page)
+			if (!hits)
+				byPage.set(page, hits = [])
+			hits.push(hit)
+		}
+		// Occurrences are in page order, and so is the map.
+		return Array.from(byPage, ([ page, hits ]) => ({ page, hits }))
+	}
+
+	// Occurrences of a term are sorted by page and word.
+	_findOccurrence(term, page, word) {
+		let lo = this.termStart[term]
+		let hi = this.termStart[term + 1] - 1
+		while (lo <= hi) {
+			let mid = (lo + hi) >> 1
+			let d = this.occurrencePage[mid] - page || this.occurrenceWord[mid] - word
+			if (d < 0)
+				lo = mid + 1
+			else if (d > 0)
+				hi = mid - 1
+			else
+				return mid
+		}
+		return -1
+	}
+
+	_quad(k) {
+		return Array.from(this.occurrenceQuad.subarray(k * 8, k * 8 + 8))
+	}
+
+	toArrayBuffer() {
+		if (this.byteOffset === 0 && this.byteLength === this.buffer.byteLength)
+			return this.buffer
+		return this.buffer.slice(this.byteOffset, this.byteOffset + this.byteLength)
+	}
+
+	toBuffer() {
+		return new Buffer(this.toArrayBuffer())
+	}
 }
 
 class Device extends Userdata {
@@ -1077,15 +1882,17 @@ class DisplayListDevice extends Device {
 class DocumentWriter extends Userdata {
 	static _drop = "_wasm_drop_document_writer"
 
-	constructor(buffer, format, options) {
-		checkType(buffer, Buffer)
-		super(
-			libmupdf._wasm_new_document_writer_with_buffer(
-				buffer,
-				STRING(format),
-				STRING(options)
-			)
-		)
+	// Write to a Buffer, or to an Output to not keep the result in memory.
+	constructor(dest, format, options) {
+		let pointer
+		if (dest instanceof Output) {
+			pointer = libmupdf._wasm_new_document_writer_with_output(dest, STRING(format), STRING2(options))
+			dest._give()
+		} else {
+			checkType(dest, Buffer)
+			pointer = libmupdf._wasm_new_document_writer_with_buffer(dest, STRING(format), STRING2(options))
+		}
+		super(pointer)
 	}
 
 	beginPage(mediabox) {
@@ -1249,6 +2056,77 @@ class Document extends Userdata {
 		return null
 	}
 
+	// Interpret the pages one at a time, then rasterize them all in parallel.
+	renderPages(pages, matrix, colorspace, alpha = false, showExtras = true, cookie = null) {
+		let lists = []
+		try {
+			for (let index of pages) {
+				let page = this.loadPage(index)
+				try {
+					lists.push(page.toDisplayList(showExtras, cookie))
+				} finally {
+					page.destroy()
+				}
+			}
+			return DisplayList.toPixmaps(lists, matrix, colorspace, alpha, cookie)
+		} finally {
+			for (let list of lists)
+				list.destroy()
+		}
+	}
+
+	// Render the pages to fit within maxWidth by maxHeight pixels, without
+	// annotations and widgets, and with images decoded at a reduced
+	// resolution to suit. The threaded build renders them in parallel. A page
+	// that cannot be loaded or rendered gets null, unless it has yet to be
+	// fetched, which throws TryLaterError as for a single page.
+	renderThumbnails(pages, maxWidth, maxHeight, colorspace = ColorSpace.DeviceRGB) {
+		checkType(colorspace, ColorSpace)
+		let n = pages.length
+		let pages_ptr = 0
+		let out_ptr = 0
+		try {
+			pages_ptr = libmupdf._wasm_malloc(4 * n)
+			out_ptr = libmupdf._wasm_malloc(4 * n)
+			for (let i = 0; i < n; ++i)
+				libmupdf.HEAP32[(pages_ptr >> 2) + i] = pages[i]
+			libmupdf._wasm_new_thumbnails(this, pages_ptr, n, maxWidth, maxHeight, colorspace, out_ptr)
+			let result = new Array(n)
+			for (let i = 0; i < n; ++i) {
+				let pointer = libmupdf.HEAP32[(out_ptr >> 2) + i]
+				result[i] = pointer ? new Pixmap(pointer) : null
+			}
+			return result
+		} finally {
+			libmupdf._wasm_free(out_ptr)
+			libmupdf._wasm_free(pages_ptr)
+		}
+	}
+
+	createTextIndex(onPage = null) {
+		return TextIndex.build(this, onPage)
+	}
+
+	// Search the pages in order, starting at page index 'from'. Yields
+	// { page, hits, next } for each page with hits, where 'next' is the page
+	// index to pass as 'from' to resume the search after this page. Pages
+	// are only searched as the results are consumed.
+	*search(needle, from = 0, max_hits = 500) {
+		checkType(needle, "string")
+		let n = this.countPages()
+		for (let index = from; index < n; ++index) {
+			let page = this.loadPage(index)
+			let hits
+			try {
+				hits = page.search(needle, max_hits)
+			} finally {
+				page.destroy()
+			}
+			if (hits.length > 0)
+				yield { page: index, hits, next: index + 1 }
+		}
+	}
+
 	resolveLink(link) {
 		if (link instanceof Link)
 			return libmupdf._wasm_resolve_link(this, libmupdf._wasm_link_uri(link))
@@ -1287,31 +2165,37 @@ class Page extends Userdata {
 		return fromString(libmupdf._wasm_page_label(this))
 	}
 
-	run(device, matrix) {
+	// See Document.renderThumbnails.
+	toThumbnail(maxWidth, maxHeight, colorspace = ColorSpace.DeviceRGB) {
+		checkType(colorspace, ColorSpace)
+		return new Pixmap(libmupdf._wasm_new_thumbnail(this, maxWidth, maxHeight, colorspace))
+	}
+
+	run(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_run_page(this, device, MATRIX(matrix))
+		libmupdf._wasm_run_page(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	runPageContents(device, matrix) {
+	runPageContents(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_run_page_contents(this, device, MATRIX(matrix))
+		libmupdf._wasm_run_page_contents(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	runPageAnnots(device, matrix) {
+	runPageAnnots(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_run_page_annots(this, device, MATRIX(matrix))
+		libmupdf._wasm_run_page_annots(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	runPageWidgets(device, matrix) {
+	runPageWidgets(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_run_page_widgets(this, device, MATRIX(matrix))
+		libmupdf._wasm_run_page_widgets(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	toPixmap(matrix, colorspace, alpha = false, showExtras = true) {
+	toPixmap(matrix, colorspace, alpha = false, showExtras = true, cookie = null) {
 		checkType(colorspace, ColorSpace)
 		checkMatrix(matrix)
 		let result
@@ -1319,27 +2203,52 @@ class Page extends Userdata {
 			result = libmupdf._wasm_new_pixmap_from_page(this,
 				MATRIX(matrix),
 				colorspace,
-				alpha)
+				alpha,
+				COOKIE(cookie))
 		else
 			result = libmupdf._wasm_new_pixmap_from_page_contents(this,
 				MATRIX(matrix),
 				colorspace,
-				alpha)
+				alpha,
+				COOKIE(cookie))
 		return new Pixmap(result)
 	}
 
-	toDisplayList(showExtras = true) {
+	// Render in bands of bandHeight rows, encoding each band into output
+	// (which is closed when done) as soon as it is drawn, so that memory use
+	// depends on the band height and not on the size of the image. The format
+	// is "png", "pnm", "pam", "pwg" or "pclm", with options for PCLm.
+	writeBanded(output, format, matrix, colorspace, alpha = false, bandHeight = 256, options = "", showExtras = true, cookie = null) {
+		checkType(output, Output)
+		checkMatrix(matrix)
+		checkType(colorspace, ColorSpace)
+		output._write(() => libmupdf._wasm_write_banded_page(
+			output,
+			this,
+			!showExtras,
+			MATRIX(matrix),
+			colorspace,
+			alpha,
+			bandHeight,
+			matrixResolution(matrix),
+			STRING(format),
+			STRING2(options),
+			COOKIE(cookie)
+		))
+	}
+
+	toDisplayList(showExtras = true, cookie = null) {
 		let result
 		if (showExtras)
-			result = libmupdf._wasm_new_display_list_from_page(this)
+			result = libmupdf._wasm_new_display_list_from_page(this, COOKIE(cookie))
 		else
-			result = libmupdf._wasm_new_display_list_from_page_contents(this)
+			result = libmupdf._wasm_new_display_list_from_page_contents(this, COOKIE(cookie))
 		return new DisplayList(result)
 	}
 
-	toStructuredText(options) {
+	toStructuredText(options, cookie = null) {
 		// TODO: parse options
-		return new StructuredText(libmupdf._wasm_new_stext_page_from_page(this))
+		return new StructuredText(libmupdf._wasm_new_stext_page_from_page(this, COOKIE(cookie)))
 	}
 
 	getLinks() {
@@ -1353,32 +2262,7 @@ class Page extends Userdata {
 	}
 
 	search(needle, max_hits = 500) {
-		checkType(needle, "string")
-		let hits = 0
-		let marks = 0
-		try {
-			hits = libmupdf._wasm_malloc(32 * max_hits)
-			marks = libmupdf._wasm_malloc(4 * max_hits)
-			let n = libmupdf._wasm_search_page(this, STRING(needle), marks, hits, max_hits)
-			let outer = []
-			if (n > 0) {
-				let inner = []
-				for (let i = 0; i < n; ++i) {
-					let mark = libmupdf.HEAP32[(marks>>2) + i]
-					let quad = fromQuad(hits + i * 32)
-					if (i > 0 && mark) {
-						outer.push(inner)
-						inner = []
-					}
-					inner.push(quad)
-				}
-				outer.push(inner)
-			}
-			return outer
-		} finally {
-			libmupdf._wasm_free(marks)
-			libmupdf._wasm_free(hits)
-		}
+		return runSearch(libmupdf._wasm_search_page, this, needle, max_hits)
 	}
 }
 
@@ -1573,6 +2457,35 @@ class PDFDocument extends Document {
 		return new Buffer(libmupdf._wasm_pdf_write_document_buffer(this, STRING(options)))
 	}
 
+	// Write the document to an Output, which is closed when done.
+	save(output, options) {
+		checkType(output, Output)
+		output._write(() => libmupdf._wasm_pdf_write_document(this, output, STRING(options)))
+	}
+
+	// Write only the changes, as the section that an incremental save
+	// appends to the original file, to a new Output which is closed when
+	// done. Append it to the original bytes to get the saved file. Nothing is
+	// written if there are no changes. See canBeSavedIncrementally.
+	// MuPDF reads the whole original file to do this, so a progressively
+	// loaded document must be loaded completely, with a cache that holds
+	// all of it; otherwise this throws.
+	saveUpdate(output, options = "") {
+		checkType(output, Output)
+		output._write(() => libmupdf._wasm_pdf_write_document_update(this, output, STRING(options)))
+	}
+
+	saveUpdateToUint8Array(options = "") {
+		let sink = new ChunkSink()
+		let output = new Output(sink)
+		try {
+			this.saveUpdate(output, options)
+		} finally {
+			output.destroy()
+		}
+		return sink.asUint8Array()
+	}
+
 	static PAGE_LABEL_NONE = "\0"
 	static PAGE_LABEL_DECIMAL = "D"
 	static PAGE_LABEL_ROMAN_UC = "R"
@@ -1916,13 +2829,13 @@ class PDFAnnotation extends Userdata {
 		return fromRect(libmupdf._wasm_pdf_bound_annot(this))
 	}
 
-	run(device, matrix) {
+	run(device, matrix, cookie = null) {
 		checkType(device, Device)
 		checkMatrix(matrix)
-		libmupdf._wasm_pdf_run_annot(this, device, MATRIX(matrix))
+		libmupdf._wasm_pdf_run_annot(this, device, MATRIX(matrix), COOKIE(cookie))
 	}
 
-	toPixmap(matrix, colorspace, alpha = false) {
+	toPixmap(matrix, colorspace, alpha = false, cookie = null) {
 		checkMatrix(matrix)
 		checkType(colorspace, ColorSpace)
 		return new Pixmap(
@@ -1930,7 +2843,8 @@ class PDFAnnotation extends Userdata {
 				this,
 				MATRIX(matrix),
 				colorspace,
-				alpha)
+				alpha,
+				COOKIE(cookie))
 		)
 	}
 
@@ -2218,104 +3132,826 @@ class TryLaterError extends Error {
 	}
 }
 
+// A stream reads its bytes from a source in blocks, as MuPDF needs them.
+// A source has:
+//   read(offset, length): returns a Uint8Array or ArrayBuffer with the
+//     bytes, or a Promise of one; MuPDF retries with TRYLATER meanwhile.
+//   readInto(offset, target): instead of read, fills a Uint8Array
+//     synchronously. The target is the stream's own memory, so nothing is
+//     copied again.
+//   close(): optional.
+//
+// Options for the stream:
+//   maxInflight: how many asynchronous reads may be in flight at once (4)
+//   maxSpan: the most blocks to ask for in one read (64)
+//   cacheSize: how many bytes of the file to keep in memory; blocks read
+//     least recently are dropped and read again when needed. The default
+//     of 0 keeps the whole file.
 class Stream extends Userdata {
 	static _drop = "_wasm_drop_stream"
-	constructor(url, contentLength, block_size, prefetch) {
-		super(libmupdf._wasm_open_stream_from_url(STRING(url), contentLength, block_size, prefetch))
+	constructor(url, contentLength, block_size, prefetch, options = {}) {
+		let pointer = url
+		if (typeof url === "string")
+			pointer = openStream(new HttpSource(url), url, contentLength, block_size, prefetch, options)
+		super(pointer)
+	}
+
+	// Options may also give blockSize (64K) and prefetch (false).
+	static fromReader(source, contentLength, options = {}) {
+		let blockSize = options.blockSize ?? 1 << 16
+		return new Stream(openStream(source, "reader", contentLength, blockSize, options.prefetch ?? 0, options))
+	}
+
+	// Open a URL, keeping fetched blocks in options.store across sessions.
+	// The blocks are only reused while the validator (the ETag or
+	// Last-Modified header) is unchanged; without one nothing is stored.
+	// Stored blocks the store has in memory are served without a TRYLATER
+	// round-trip; see IndexedDBBlockStore for how it reads ahead.
+	// The content length and validator are taken from a HEAD request if
+	// not given. The URL is read with fetch unless options.source gives
+	// another reader of it, such as one that shares fetched data between
+	// workers.
+	static async fromUrl(url, options = {}) {
+		let contentLength = options.contentLength
+		let validator = options.validator
+		if (contentLength == null || (options.store && validator === undefined)) {
+			let head = await fetch(url, { method: "HEAD" })
+			if (!head.ok)
+				throw new Error(`HTTP ${head.status}`)
+			contentLength = contentLength ?? Number(head.headers.get("Content-Length"))
+			validator = validator ?? head.headers.get("ETag") ?? head.headers.get("Last-Modified")
+		}
+		let blockSize = options.blockSize ?? 1 << 16
+		let source = options.source ?? new HttpSource(url)
+		if (options.store && validator) {
+			let key = `${url}\n${validator}\n${blockSize}`
+			await options.store.open(key)
+			source = new CachedSource(source, options.store, key, blockSize)
+		}
+		return new Stream(openStream(source, url, contentLength, blockSize, options.prefetch ?? 0, options))
+	}
+
+	// Read a file through a Node file descriptor, without loading it whole:
+	// unless options.cacheSize says otherwise, at most 64 MB of it is kept.
+	static fromFile(path, options = {}) {
+		let source = new FileSource(path)
+		return Stream.fromReader(source, source.size, { cacheSize: 64 << 20, ...options })
+	}
+
+	_state() {
+		return fetchStates.get(libmupdf._wasm_stream_get_state(this))
+	}
+
+	getLength() {
+		return this._state()?.contentLength ?? 0
+	}
+
+	// Add data read by other means, such as by another worker, to the block
+	// store of a stream opened with one (see fromUrl). The offset is at the
+	// start of a block.
+	storeRange(offset, data) {
+		this._state()?.source.save?.(offset, data)
+	}
+
+	// How many bytes have arrived so far, counting blocks read again after
+	// being dropped from a bounded cache only once.
+	getBytesReceived() {
+		return this._state()?.received ?? 0
+	}
+
+	isComplete() {
+		let state = this._state()
+		return state ? state.received >= state.contentLength : false
 	}
 }
 
-// TODO - move in Stream
-function onFetchData(id, block, data) {
-	let n = data.byteLength
-	let p = libmupdf._wasm_malloc(n)
-	libmupdf.HEAPU8.set(new Uint8Array(data), p)
-	libmupdf._wasm_on_data_fetched(id, block, p, n)
-	libmupdf._wasm_free(p)
+function openStream(source, name, contentLength, block_size, prefetch, options) {
+	// fetchOpen is called from inside _wasm_open_stream_from_url.
+	fetchPending = { source, options }
+	try {
+		// Sources that read synchronously never make MuPDF wait, so they
+		// are opened the ordinary way.
+		let progressive = typeof source.readInto !== "function"
+		return libmupdf._wasm_open_stream_from_url(STRING(name), contentLength, block_size, prefetch, options.cacheSize ?? 0, progressive)
+	} finally {
+		fetchPending = null
+	}
 }
 
-// TODO - replace with map
-let fetchStates = {}
+class HttpSource {
+	constructor(url) {
+		this.url = url
+	}
 
-function fetchOpen(id, url, contentLength, blockShift, prefetch) {
-	console.log("OPEN", url, "PROGRESSIVELY")
-	fetchStates[id] = {
-		url: url,
-		blockShift: blockShift,
-		blockSize: 1 << blockShift,
-		prefetch: prefetch,
-		contentLength: contentLength,
-		map: new Array((contentLength >>> blockShift) + 1).fill(0),
-		closed: false,
+	// A server that ignores Range sends the whole file.
+	async read(offset, length) {
+		let response = await fetch(this.url, { headers: { Range: `bytes=${offset}-${offset + length - 1}` } })
+		if (!response.ok)
+			throw new Error(`HTTP ${response.status}`)
+		// TODO - use ReadableStream instead?
+		return response.arrayBuffer()
 	}
 }
 
-async function fetchRead(id, block) {
-	let state = fetchStates[id]
+class FileSource {
+	constructor(path) {
+		this.fs = require("fs")
+		this.fd = this.fs.openSync(path, "r")
+		this.size = this.fs.fstatSync(this.fd).size
+	}
 
-	if (state.map[block] > 0)
-		return
+	readInto(offset, target) {
+		let n = 0
+		while (n < target.length) {
+			let k = this.fs.readSync(this.fd, target, n, target.length - n, offset + n)
+			if (k === 0)
+				throw new Error("unexpected end of file")
+			n += k
+		}
+	}
 
-	state.map[block] = 1
-	let contentLength = state.contentLength
-	let url = state.url
-	let start = block << state.blockShift
-	let end = start + state.blockSize
-	if (end > contentLength)
-		end = contentLength
+	close() {
+		this.fs.closeSync(this.fd)
+	}
+}
 
-	try {
-		let response = await fetch(url, { headers: { Range: `bytes=${start}-${end - 1}` } })
-		if (state.closed)
+// Serves blocks kept in a store from earlier sessions, and adds the blocks
+// the inner source reads to the store. Reads are block aligned; a read is
+// either all stored blocks or none (see fetchNextRange).
+class CachedSource {
+	constructor(source, store, key, blockSize) {
+		this.source = source
+		this.store = store
+		this.key = key
+		this.blockSize = blockSize
+	}
+
+	has(block) {
+		return this.store.has(this.key, block)
+	}
+
+	read(offset, length) {
+		let first = offset / this.blockSize
+		if (this.has(first)) {
+			let parts = []
+			for (let at = 0; at < length; at += this.blockSize)
+				parts.push(this.store.get(this.key, first + at / this.blockSize))
+			if (parts.some((part) => typeof part?.then === "function"))
+				return Promise.all(parts).then((parts) => this._join(offset, length, parts))
+			return this._join(offset, length, parts)
+		}
+		return this._fetch(offset, length)
+	}
+
+	_join(offset, length, parts) {
+		// A block dropped from the store since it was opened is read again.
+		if (parts.includes(null))
+			return this._fetch(offset, length)
+		let data = new Uint8Array(length)
+		parts.forEach((part, i) => data.set(part.subarray(0, length - i * this.blockSize), i * this.blockSize))
+		return data
+	}
+
+	_fetch(offset, length) {
+		return Promise.resolve(this.source.read(offset, length)).then((data) => {
+			data = new Uint8Array(data)
+			// Only store what was asked for; see HttpSource for more.
+			if (data.length === length)
+				this.save(offset, data)
+			return data
+		})
+	}
+
+	// Add blocks read by other means, such as by another worker.
+	save(offset, data) {
+		let first = offset / this.blockSize
+		for (let at = 0; at < data.length; at += this.blockSize)
+			this.store.put(this.key, first + at / this.blockSize, data.slice(at, at + this.blockSize))
+	}
+
+	close() {
+		this.store.close(this.key)
+		this.source.close?.()
+	}
+}
+
+// Block stores for CachedSource. After open(key) resolves, has answers
+// synchronously; get may return a promise, and gives null for a block that
+// has been dropped since; put may finish in the background. Each open(key)
+// is matched by a close(key) when the stream is dropped.
+//
+// Several stores may read the same blocks (one per worker, say), but only
+// one should write them: it keeps the blocks of all documents under its
+// limit (1 GB by default) by dropping the documents least recently used,
+// other than those it has open. A document larger than the limit is only
+// stored in part.
+
+function idbResult(request) {
+	return new Promise((resolve, reject) => {
+		request.onsuccess = () => resolve(request.result)
+		request.onerror = () => reject(request.error)
+	})
+}
+
+// Browser store in IndexedDB. Opening a document lists its stored blocks
+// and reads the first of them into memory. IndexedDB can only be read
+// asynchronously, so get serves blocks from memory when it can, and reads
+// the stored blocks that follow ahead of the reader, up to options.readAhead
+// bytes (16 MB) in all; only a block that is not in memory yet costs a
+// TRYLATER round-trip.
+class IndexedDBBlockStore {
+	constructor(name = "mupdf-blocks", options = {}) {
+		this.name = name
+		this.readOnly = options.readOnly ?? false
+		this.limit = options.limit ?? 1 << 30
+		this.readAhead = options.readAhead ?? 16 << 20
+		this.db = null
+		this.blocks = new Map()
+		this.opened = new Map()
+		this.documents = new Map()
+		this.size = 0
+		// Blocks read ahead, by `${key}\n${block}`, oldest first.
+		this.memory = new Map()
+		this.memorySize = 0
+		// Per document: the read ahead in progress, and the end and length
+		// of the last one.
+		this.pending = new Map()
+		this.ahead = new Map()
+	}
+
+	_db() {
+		if (!this.db)
+			this.db = this._open()
+		return this.db
+	}
+
+	async _open() {
+		let request = indexedDB.open(this.name, 2)
+		// Version 1 did not record the size of each document.
+		request.onupgradeneeded = () => {
+			let db = request.result
+			for (let name of Array.from(db.objectStoreNames))
+				db.deleteObjectStore(name)
+			db.createObjectStore("blocks")
+			db.createObjectStore("documents")
+		}
+		let db = await idbResult(request)
+		if (!this.readOnly) {
+			let documents = db.transaction("documents").objectStore("documents")
+			let [ keys, values ] = await Promise.all([
+				idbResult(documents.getAllKeys()),
+				idbResult(documents.getAll()),
+			])
+			keys.forEach((key, i) => {
+				this.documents.set(key, values[i])
+				this.size += values[i].size
+			})
+		}
+		return db
+	}
+
+	async open(key) {
+		let db = await this._db()
+		let range = IDBKeyRange.bound([ key, 0 ], [ key, Infinity ])
+		let keys = await idbResult(db.transaction("blocks").objectStore("blocks").getAllKeys(range))
+		this.opened.set(key, (this.opened.get(key) ?? 0) + 1)
+		if (!this.blocks.has(key))
+			this.blocks.set(key, new Set(keys.map((k) => k[1])))
+		if (!this.readOnly) {
+			let doc = this.documents.get(key) ?? { size: 0, used: 0 }
+			doc.used = Date.now()
+			this.documents.set(key, doc)
+			db.transaction("documents", "readwrite").objectStore("documents").put(doc, key)
+		}
+		if (keys.length > 0)
+			await this._readAhead(key, keys[0][1])
+	}
+
+	close(key) {
+		let count = this.opened.get(key) - 1
+		if (count > 0) {
+			this.opened.set(key, count)
 			return
+		}
+		this.opened.delete(key)
+		this.blocks.delete(key)
+		this.ahead.delete(key)
+		for (let [ id, data ] of this.memory) {
+			if (id.startsWith(key + "\n")) {
+				this.memory.delete(id)
+				this.memorySize -= data.length
+			}
+		}
+	}
 
-		// TODO - use ReadableStream instead?
-		let buffer = await response.arrayBuffer()
-		if (state.closed)
+	has(key, block) {
+		return this.blocks.get(key)?.has(block) ?? false
+	}
+
+	get(key, block) {
+		let data = this._take(key, block)
+		if (data)
+			return data
+		let pending = this.pending.get(key) ?? Promise.resolve()
+		return pending
+			.then(() => this._take(key, block) ?? this._readAhead(key, block).then(() => this._take(key, block)))
+			.then((data) => data ?? null)
+	}
+
+	// Hand over a block read ahead; the stream keeps its own copy from here
+	// on. Past halfway through the last read ahead, start the next one.
+	_take(key, block) {
+		let id = `${key}\n${block}`
+		let data = this.memory.get(id)
+		if (!data)
+			return null
+		this.memory.delete(id)
+		this.memorySize -= data.length
+		let ahead = this.ahead.get(key)
+		if (ahead && !this.pending.has(key) && ahead.end - block <= ahead.count / 2 && this.has(key, ahead.end))
+			this._readAhead(key, ahead.end).catch((error) => console.log("BLOCK STORE ERROR", error.toString()))
+		return data
+	}
+
+	// Read the stored blocks of a document from first on into memory, up to
+	// half the read-ahead budget, dropping the oldest blocks read ahead
+	// before to make room.
+	_readAhead(key, first) {
+		let pending = this.pending.get(key)
+		if (pending)
+			return pending
+		pending = this._db().then((db) => new Promise((resolve, reject) => {
+			let range = IDBKeyRange.bound([ key, first ], [ key, Infinity ])
+			let request = db.transaction("blocks").objectStore("blocks").openCursor(range)
+			let bytes = 0
+			let count = 0
+			let end = first
+			request.onsuccess = () => {
+				let cursor = request.result
+				if (cursor && (count === 0 || bytes < this.readAhead / 2)) {
+					let data = new Uint8Array(cursor.value)
+					this._keep(`${key}\n${cursor.key[1]}`, data)
+					bytes += data.length
+					count += 1
+					end = cursor.key[1] + 1
+					cursor.continue()
+				} else {
+					if (this.opened.has(key))
+						this.ahead.set(key, { end, count })
+					resolve()
+				}
+			}
+			request.onerror = () => reject(request.error)
+		})).finally(() => this.pending.delete(key))
+		this.pending.set(key, pending)
+		return pending
+	}
+
+	_keep(id, data) {
+		let old = this.memory.get(id)
+		if (old) {
+			this.memory.delete(id)
+			this.memorySize -= old.length
+		}
+		this.memory.set(id, data)
+		this.memorySize += data.length
+		for (let [ oldest, oldData ] of this.memory) {
+			if (this.memorySize <= this.readAhead || oldest === id)
+				break
+			this.memory.delete(oldest)
+			this.memorySize -= oldData.length
+		}
+	}
+
+	put(key, block, data) {
+		let blocks = this.blocks.get(key)
+		if (this.readOnly || !blocks || blocks.has(block))
+			return
+		let doc = this.documents.get(key)
+		if (doc.size + data.length > this.limit)
 			return
+		blocks.add(block)
+		doc.size += data.length
+		this.size += data.length
+		this._db().then((db) => {
+			let transaction = db.transaction([ "blocks", "documents" ], "readwrite")
+			transaction.objectStore("blocks").put(data.buffer, [ key, block ])
+			transaction.objectStore("documents").put(doc, key)
+			this._evict(transaction)
+		}).catch((error) => console.log("BLOCK STORE ERROR", error.toString()))
+	}
+
+	_evict(transaction) {
+		if (this.size <= this.limit)
+			return
+		let unused = Array.from(this.documents).filter(([ key ]) => !this.opened.has(key))
+		unused.sort((a, b) => a[1].used - b[1].used)
+		for (let [ key, doc ] of unused) {
+			if (this.size <= this.limit)
+				break
+			transaction.objectStore("blocks").delete(IDBKeyRange.bound([ key, 0 ], [ key, Infinity ]))
+			transaction.objectStore("documents").delete(key)
+			this.documents.delete(key)
+			this.size -= doc.size
+		}
+	}
+}
 
-		console.log("READ", url, block + 1, "/", state.map.length)
-		state.map[block] = 2
+// Node store with one file per block, in a directory per document. The
+// modification time of a directory tells when it was last used.
+class FileBlockStore {
+	constructor(dir, options = {}) {
+		this.fs = require("fs")
+		this.path = require("path")
+		this.crypto = require("crypto")
+		this.dir = dir
+		this.readOnly = options.readOnly ?? false
+		this.limit = options.limit ?? 1 << 30
+		this.dirs = new Map()
+		this.opened = new Map()
+		this.sizes = null
+		this.size = 0
+	}
+
+	_scan() {
+		this.sizes = new Map()
+		this.fs.mkdirSync(this.dir, { recursive: true })
+		for (let name of this.fs.readdirSync(this.dir)) {
+			let dir = this.path.join(this.dir, name)
+			let size = 0
+			for (let file of this.fs.readdirSync(dir))
+				size += this.fs.statSync(this.path.join(dir, file)).size
+			this.sizes.set(dir, size)
+			this.size += size
+		}
+	}
 
-		onFetchData(id, block, buffer)
+	async open(key) {
+		let dir = this.path.join(this.dir, this.crypto.createHash("sha1").update(key).digest("hex"))
+		this.dirs.set(key, dir)
+		this.opened.set(key, (this.opened.get(key) ?? 0) + 1)
+		if (!this.readOnly) {
+			if (!this.sizes)
+				this._scan()
+			this.fs.mkdirSync(dir, { recursive: true })
+			let now = new Date()
+			this.fs.utimesSync(dir, now, now)
+			if (!this.sizes.has(dir))
+				this.sizes.set(dir, 0)
+		}
+	}
 
-		onFetchCompleted(id)
+	close(key) {
+		let count = this.opened.get(key) - 1
+		if (count > 0) {
+			this.opened.set(key, count)
+		} else {
+			this.opened.delete(key)
+			this.dirs.delete(key)
+		}
+	}
 
-		// TODO - Does this create a risk of stack overflow?
-		if (state.prefetch)
-			fetchReadNext(id, block + 1)
-	} catch (error) {
-		state.map[block] = 0
-		console.log("FETCH ERROR", url, block, error.toString)
+	_file(key, block) {
+		return this.path.join(this.dirs.get(key), String(block))
+	}
+
+	has(key, block) {
+		return this.fs.existsSync(this._file(key, block))
+	}
+
+	get(key, block) {
+		try {
+			return this.fs.readFileSync(this._file(key, block))
+		} catch (error) {
+			return null
+		}
+	}
+
+	put(key, block, data) {
+		let dir = this.dirs.get(key)
+		if (this.readOnly || !dir || this.has(key, block))
+			return
+		let size = this.sizes.get(dir)
+		if (size + data.length > this.limit)
+			return
+		// Write then rename, so a reader never sees part of a block.
+		let file = this._file(key, block)
+		this.fs.writeFileSync(file + ".tmp", data)
+		this.fs.renameSync(file + ".tmp", file)
+		this.sizes.set(dir, size + data.length)
+		this.size += data.length
+		this._evict()
+	}
+
+	_evict() {
+		if (this.size <= this.limit)
+			return
+		let open = new Set(this.dirs.values())
+		let unused = Array.from(this.sizes.keys()).filter((dir) => !open.has(dir))
+		unused = unused.map((dir) => [ dir, this.fs.statSync(dir).mtimeMs ])
+		unused.sort((a, b) => a[1] - b[1])
+		for (let [ dir ] of unused) {
+			if (this.size <= this.limit)
+				break
+			this.fs.rmSync(dir, { recursive: true, force: true })
+			this.size -= this.sizes.get(dir)
+			this.sizes.delete(dir)
+		}
 	}
 }
 
-function fetchReadNext(id, next) {
-	let state = fetchStates[id]
+const fetchStates = new Map()
+let fetchPending = null
+
+// Blocks are requested in this order: blocks MuPDF is waiting for, then
+// hinted ranges (the file header, the trailer and, for linearized files,
+// the first page), then the rest of the file in order if prefetching.
+// Adjacent missing blocks are merged into one read.
+//
+// When the stream only has room for some of the blocks (slotCount), reads
+// are kept to half of that so a read does not evict its own blocks, and
+// nothing is read ahead of need beyond the header and trailer.
+//
+// A source with readInto is only asked for the blocks MuPDF needs, as it
+// needs them.
+function fetchOpen(id, url, contentLength, blockShift, prefetch, slotCount) {
+	let { source, options } = fetchPending
+	// The same block count as wasm_open_stream_from_url.
+	let blocks = Math.max(1, Math.ceil(contentLength / (1 << blockShift)))
+	let cached = slotCount < blocks
+	let sync = typeof source.readInto === "function"
+	console.log("OPEN", url, "PROGRESSIVELY")
+	let state = {
+		id,
+		url,
+		source,
+		sync,
+		blockShift,
+		blockSize: 1 << blockShift,
+		prefetch: prefetch && !cached && !sync,
+		cached,
+		contentLength,
+		// 0 = missing, 1 = requested, 2 = loaded, 3 = failed for good; see
+		// wasm_stream_block_state.
+		map: new Uint8Array(blocks),
+		// Which blocks have ever been loaded, and how many bytes that is.
+		seen: new Uint8Array(blocks),
+		received: 0,
+		closed: false,
+		maxInflight: options.maxInflight ?? 4,
+		maxSpan: cached ? Math.max(1, Math.min(options.maxSpan ?? 64, slotCount >> 1)) : options.maxSpan ?? 64,
+		inflight: 0,
+		demand: [],
+		hints: sync ? [] : [ [ 0, 1 ], [ blocks - 1, blocks ] ],
+		next: 0,
+		// Shortest time a read took, as an estimate of latency, in ms.
+		latency: 0,
+		// Bytes per ms, smoothed.
+		throughput: 0,
+	}
+	fetchStates.set(id, state)
+	fetchSchedule(state)
+}
+
+// The stream dropped a block to make room for another.
+function fetchEvict(id, block) {
+	let state = fetchStates.get(id)
+	if (state)
+		state.map[block] = 0
+}
+
+function fetchRead(id, block) {
+	let state = fetchStates.get(id)
 	if (!state)
 		return
+	if (state.sync) {
+		fetchReadInto(state, block)
+		return
+	}
+	if (state.map[block] === 0)
+		state.demand.push(block)
+	fetchSchedule(state)
+}
 
-	// Don't prefetch if we're already waiting for any blocks.
-	for (let block = 0; block < state.map.length; ++block)
-		if (state.map[block] === 1)
-			return
+// Read one block straight into its slot in the stream.
+function fetchReadInto(state, block) {
+	// Offsets may be past 2 GB, so no bit shifts.
+	let start = block * state.blockSize
+	let length = Math.min(state.blockSize, state.contentLength - start)
+	let p = libmupdf._wasm_stream_block_slot(state.id, block)
+	if (!p)
+		return
+	try {
+		state.source.readInto(start, libmupdf.HEAPU8.subarray(p, p + length))
+		libmupdf._wasm_stream_block_loaded(state.id, block, 1)
+		state.map[block] = 2
+		fetchSeen(state, block, length)
+	} catch (error) {
+		console.log("READ ERROR", state.url, block, error.toString())
+		libmupdf._wasm_stream_block_loaded(state.id, block, 0)
+		state.map[block] = libmupdf._wasm_stream_block_state(state.id, block)
+	}
+}
 
-	// Find next block to prefetch (starting with the last fetched block)
-	for (let block = next; block < state.map.length; ++block)
-		if (state.map[block] === 0)
-			return fetchRead(id, block)
+// Copy fetched data into the slots of the blocks it covers.
+function fetchStore(state, first, data) {
+	for (let block = first, offset = 0; offset < data.length; ++block, offset += state.blockSize) {
+		let p = libmupdf._wasm_stream_block_slot(state.id, block)
+		if (p) {
+			let bytes = data.subarray(offset, offset + state.blockSize)
+			libmupdf.HEAPU8.set(bytes, p)
+			libmupdf._wasm_stream_block_loaded(state.id, block, 1)
+			fetchSeen(state, block, bytes.length)
+		}
+	}
+}
+
+function fetchSeen(state, block, length) {
+	if (!state.seen[block]) {
+		state.seen[block] = 1
+		state.received += length
+	}
+}
+
+// How many blocks to ask for at once: enough to cover the bandwidth-delay
+// product twice over, so read latency is not what limits us.
+function fetchSpan(state) {
+	if (state.throughput === 0)
+		return Math.min(4, state.maxSpan)
+	let bytes = 2 * state.throughput * state.latency
+	return Math.max(1, Math.min(state.maxSpan, Math.ceil(bytes / state.blockSize)))
+}
+
+// Return [ first, end ) of the next range of missing blocks to request.
+function fetchNextRange(state) {
+	let span = fetchSpan(state)
+	let has = (block) => state.source.has?.(block) ?? false
+	let extend = (first, limit) => {
+		let stored = has(first)
+		let end = first + 1
+		while (end < limit && end - first < span && state.map[end] === 0 && has(end) === stored)
+			++end
+		return [ first, end ]
+	}
 
-	// Find next block to prefetch (starting from the beginning)
-	for (let block = 0; block < state.map.length; ++block)
+	while (state.demand.length > 0) {
+		let block = state.demand.shift()
 		if (state.map[block] === 0)
-			return fetchRead(id, block)
+			return extend(block, state.map.length)
+	}
 
-	console.log("ALL BLOCKS READ")
+	while (state.hints.length > 0) {
+		let [ first, end ] = state.hints[0]
+		while (first < end && state.map[first] !== 0)
+			++first
+		if (first < end) {
+			state.hints[0][0] = first
+			return extend(first, end)
+		}
+		state.hints.shift()
+	}
+
+	if (state.prefetch) {
+		for (let i = 0; i < state.map.length; ++i) {
+			let block = (state.next + i) % state.map.length
+			if (state.map[block] === 0)
+				return extend(block, state.map.length)
+		}
+	}
+
+	return null
+}
+
+function fetchSchedule(state) {
+	while (!state.closed && state.inflight < state.maxInflight) {
+		let range = fetchNextRange(state)
+		if (!range)
+			break
+		fetchRange(state, range[0], range[1])
+	}
+}
+
+function fetchRange(state, first, end) {
+	let start = first * state.blockSize
+	let stop = Math.min(end * state.blockSize, state.contentLength)
+	let t0 = performance.now()
+
+	state.map.fill(1, first, end)
+
+	let done = (data) => {
+		if (state.closed)
+			return
+		data = new Uint8Array(data)
+
+		let time = performance.now() - t0
+		state.latency = state.latency ? Math.min(state.latency, time) : time
+		let rate = data.length / Math.max(time - state.latency, 1)
+		state.throughput = state.throughput ? (state.throughput + rate) / 2 : rate
+
+		// More than we asked for is the whole file.
+		let askedFirst = first
+		let askedEnd = end
+		if (data.length > stop - start) {
+			first = 0
+			end = state.map.length
+		}
+
+		console.log("READ", state.url, first + 1, "-", end, "/", state.map.length)
+		state.next = end
+
+		fetchStore(state, first, data)
+
+		// Blocks we asked for past the end of a short read count as failed
+		// reads. Those the data covered are loaded, unless a bounded cache
+		// dropped them again to make room for later ones, which leaves them
+		// missing but is no fault of the read. Blocks that only other reads
+		// asked for are theirs to settle.
+		let covered = first + Math.ceil(data.length / state.blockSize)
+		for (let block = first; block < end; ++block) {
+			let mine = block >= askedFirst && block < askedEnd
+			let blockState = libmupdf._wasm_stream_block_state(state.id, block)
+			if (mine && block >= covered && blockState < 2) {
+				libmupdf._wasm_stream_block_loaded(state.id, block, 0)
+				blockState = libmupdf._wasm_stream_block_state(state.id, block)
+			}
+			if (mine || blockState === 2)
+				state.map[block] = blockState
+			// The stream asked for it again while our read was in flight.
+			if (mine && blockState === 1) {
+				state.map[block] = 0
+				state.demand.push(block)
+			}
+		}
+
+		if (first === 0)
+			fetchLinearizationHints(state, data.subarray(0, 1024))
+	}
+
+	let failed = (error) => {
+		if (state.closed)
+			return
+		console.log("FETCH ERROR", state.url, first, error.toString())
+		// The stream reads the blocks again when it next needs them, unless
+		// they have failed too often.
+		for (let block = first; block < end; ++block) {
+			libmupdf._wasm_stream_block_loaded(state.id, block, 0)
+			state.map[block] = libmupdf._wasm_stream_block_state(state.id, block)
+		}
+	}
+
+	let result
+	try {
+		result = state.source.read(start, stop - start)
+	} catch (error) {
+		failed(error)
+		return
+	}
+
+	// A source that answers at once needs no TRYLATER round-trip.
+	if (typeof result?.then !== "function") {
+		done(result)
+		return
+	}
+
+	state.inflight += 1
+	result.then(done, failed).finally(() => {
+		if (state.closed)
+			return
+		state.inflight -= 1
+		onFetchCompleted(state.id)
+		fetchSchedule(state)
+	})
+}
+
+// The linearization dictionary at the start of a linearized PDF gives the
+// end of the first page (/E) and the location of the hint stream (/H).
+// Fetch those ranges next, so the first page can be shown before the rest.
+function fetchLinearizationHints(state, header) {
+	if (state.cached)
+		return
+	let text = String.fromCharCode.apply(null, header)
+	let dict = /<<[^>]*\/Linearized[^>]*>>/.exec(text)
+	if (!dict)
+		return
+	let blockOf = (offset) => Math.floor(offset / state.blockSize)
+	let blocks = state.map.length
+	let E = /\/E\s+(\d+)/.exec(dict[0])
+	let H = /\/H\s*\[\s*(\d+)\s+(\d+)/.exec(dict[0])
+	if (H) {
+		let offset = Number(H[1])
+		state.hints.unshift([ Math.min(blockOf(offset), blocks - 1), Math.min(blockOf(offset + Number(H[2])) + 1, blocks) ])
+	}
+	if (E)
+		state.hints.unshift([ 0, Math.min(blockOf(Number(E[1])) + 1, blocks) ])
 }
 
 function fetchClose(id) {
-	fetchStates[id].closed = true
-	delete fetchStates[id]
+	let state = fetchStates.get(id)
+	if (state) {
+		state.closed = true
+		state.source.close?.()
+	}
+	fetchStates.delete(id)
 }
 
 // --- EXPORTS ---
@@ -2324,6 +3960,11 @@ const mupdf = {
 	Matrix,
 	Rect,
 	Buffer,
+	Output,
+	ChunkSink,
+	FileSink,
+	WritableStreamSink,
+	Cookie,
 	ColorSpace,
 	Font,
 	StrokeState,
@@ -2331,6 +3972,8 @@ const mupdf = {
 	Path,
 	Text,
 	Pixmap,
+	SampleBuffer,
+	TextIndex,
 	DisplayList,
 	DrawDevice,
 	DisplayListDevice,
@@ -2342,6 +3985,9 @@ const mupdf = {
 	PDFObject,
 	TryLaterError,
 	Stream,
+	IndexedDBBlockStore,
+	FileBlockStore,
+	threadCount: 1,
 	onFetchCompleted: () => {},
 }
 
@@ -2353,13 +3999,112 @@ function onFetchCompleted(id) {
 const libmupdf_injections = {
 	fetchOpen,
 	fetchRead,
+	fetchEvict,
 	fetchClose,
+	outputWrite,
+	outputClose,
+	outputDrop,
 	TryLaterError,
 }
 
-mupdf.ready = libmupdf(libmupdf_injections).then((m) => {
+// Options for loading the library, which must be set as globalThis.mupdfOptions
+// before this script is loaded:
+//   wasmModule: the library compiled as a WebAssembly.Module (see
+//     mupdf.compile), so that workers share one compilation instead of each
+//     compiling the binary again.
+//   lazyHandlers: register the document handlers when the first document is
+//     opened instead of at start.
+//   storeSize: the most memory to keep in the resource store of fonts,
+//     images and other objects that can be loaded again (default 100 MB).
+//   memoryLimit: the most memory MuPDF may use; see mupdf.setMemoryLimit.
+//   threads: the most threads the threaded build renders with, counting the
+//     calling one. Its pool of workers is started with the library, so a
+//     program that only wants the threaded build for its shared memory (to
+//     abort a cookie from another thread) can set 1 and start none.
+const mupdfOptions = globalThis.mupdfOptions ?? {}
+
+// Emscripten waits for receiveInstance forever if instantiating fails, so
+// the failure rejects mupdf.ready by this other way.
+let instantiateFailed = new Promise(() => {})
+
+if (mupdfOptions.wasmModule) {
+	let reject
+	instantiateFailed = new Promise((_, r) => { reject = r })
+	libmupdf_injections.instantiateWasm = function (imports, receiveInstance) {
+		WebAssembly.instantiate(mupdfOptions.wasmModule, imports)
+			.then((instance) => receiveInstance(instance, mupdfOptions.wasmModule))
+			.catch(reject)
+		return {}
+	}
+}
+
+// Compile the library binary (a URL, or a file path in Node), to pass as
+// wasmModule to workers. Browsers compile it while it downloads.
+mupdf.compile = function (url) {
+	if (typeof require === "function")
+		return WebAssembly.compile(require("fs").readFileSync(url))
+	return WebAssembly.compileStreaming(fetch(url))
+}
+
+// How much memory MuPDF uses, in bytes. Allocations refused by the limit
+// made MuPDF drop items from the store to make room. The wasm memory is what
+// the heap has grown to, including memory that is free again.
+mupdf.getMemoryStats = function () {
+	let p = libmupdf._wasm_memory_stats() >> 3
+	return {
+		storeLimit: libmupdf.HEAPF64[p + 0],
+		memoryLimit: libmupdf.HEAPF64[p + 1],
+		used: libmupdf.HEAPF64[p + 2],
+		peak: libmupdf.HEAPF64[p + 3],
+		allocations: libmupdf.HEAPF64[p + 4],
+		refusedAllocations: libmupdf.HEAPF64[p + 5],
+		wasmMemory: libmupdf.HEAPU8.length,
+	}
+}
+
+mupdf.resetMemoryPeak = function () {
+	libmupdf._wasm_reset_memory_peak()
+}
+
+// Keep MuPDF under this many bytes (0 for no limit). When an allocation
+// would go past it, items are dropped from the store to make room; if that
+// is not enough, the operation fails with an error instead of growing the
+// heap until the whole instance runs out of memory.
+mupdf.setMemoryLimit = function (limit) {
+	libmupdf._wasm_set_memory_limit(limit)
+}
+
+// Drop items from the store, least recently used first, until it is at
+// most percent full. Returns whether that was possible.
+mupdf.shrinkStore = function (percent) {
+	return libmupdf._wasm_shrink_store(percent) !== 0
+}
+
+mupdf.emptyStore = function () {
+	libmupdf._wasm_empty_store()
+}
+
+// A listing of the items in the store, for debugging.
+mupdf.debugStore = function () {
+	let buf = libmupdf._wasm_debug_store()
+	try {
+		let data = libmupdf._wasm_buffer_data(buf)
+		let size = libmupdf._wasm_buffer_size(buf)
+		return new TextDecoder().decode(libmupdf.HEAPU8.slice(data, data + size))
+	} finally {
+		libmupdf._wasm_drop_buffer(buf)
+	}
+}
+
+mupdf.ready = Promise.race([ libmupdf(libmupdf_injections), instantiateFailed ]).then((m) => {
 	libmupdf = m
-	libmupdf._wasm_init_context()
+	libmupdf._wasm_init_context(
+		mupdfOptions.lazyHandlers ? 1 : 0,
+		mupdfOptions.storeSize ?? 100 << 20,
+		mupdfOptions.memoryLimit ?? 0,
+		mupdfOptions.threads ?? 0
+	)
+	mupdf.threadCount = libmupdf._wasm_thread_count()
 
 	// To pass Rect and Matrix as pointer arguments
 	_wasm_point = libmupdf._wasm_malloc(4 * 2) >> 2
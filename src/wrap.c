@@ -33,7 +33,22 @@
 #include "mupdf/fitz.h"
 #include "mupdf/pdf.h"
 #include <string.h>
+#include <limits.h>
 #include <math.h>
+#include <malloc.h>
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+#include <pthread.h>
+#include "emscripten/threading.h"
+#endif
+
+#ifdef __wasm_simd128__
+#include <wasm_simd128.h>
+#endif
+
+#ifndef WASM_MAX_THREADS
+#define WASM_MAX_THREADS 1
+#endif
 
 static fz_context *ctx;
 
@@ -65,13 +80,225 @@ wasm_rethrow(fz_context *ctx)
 		EM_ASM({ throw new Error(UTF8ToString($0)); }, fz_caught_message(ctx));
 }
 
+#ifdef __EMSCRIPTEN_PTHREADS__
+
+static pthread_mutex_t wasm_mutexes[FZ_LOCK_MAX];
+
+static void wasm_lock(void *user, int lock)
+{
+	pthread_mutex_lock(&wasm_mutexes[lock]);
+}
+
+static void wasm_unlock(void *user, int lock)
+{
+	pthread_mutex_unlock(&wasm_mutexes[lock]);
+}
+
+static fz_locks_context wasm_locks = { NULL, wasm_lock, wasm_unlock };
+
+#endif
+
+// --- Memory ---
+
+// MuPDF allocates through these so that we can tell how much memory it uses.
+// With a limit set, allocations that would go past it fail, which makes
+// MuPDF drop items from the resource store and try again; if the store is
+// already empty the operation fails with an error, instead of the heap
+// growing until the whole instance runs out of memory. MuPDF does not
+// always hold the allocation lock when it calls these (creating, cloning
+// and dropping a context do not take it), so the counters have a lock of
+// their own.
+static struct {
+	double limit, used, peak;
+	double allocations, failed;
+} wasm_memory;
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+static pthread_mutex_t wasm_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void wasm_memory_lock(void)
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+	pthread_mutex_lock(&wasm_memory_mutex);
+#endif
+}
+
+static void wasm_memory_unlock(void)
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+	pthread_mutex_unlock(&wasm_memory_mutex);
+#endif
+}
+
+static void *wasm_alloc_malloc(void *user, size_t size)
+{
+	void *p = NULL;
+	wasm_memory_lock();
+	if (wasm_memory.limit > 0 && wasm_memory.used + size > wasm_memory.limit)
+	{
+		wasm_memory.failed++;
+	}
+	else
+	{
+		p = malloc(size);
+		if (p)
+		{
+			wasm_memory.allocations++;
+			wasm_memory.used += malloc_usable_size(p);
+			if (wasm_memory.used > wasm_memory.peak)
+				wasm_memory.peak = wasm_memory.used;
+		}
+	}
+	wasm_memory_unlock();
+	return p;
+}
+
+static void *wasm_alloc_realloc(void *user, void *old, size_t size)
+{
+	size_t old_size = old ? malloc_usable_size(old) : 0;
+	void *p = NULL;
+	wasm_memory_lock();
+	if (wasm_memory.limit > 0 && size > old_size && wasm_memory.used - old_size + size > wasm_memory.limit)
+	{
+		wasm_memory.failed++;
+	}
+	else
+	{
+		p = realloc(old, size);
+		if (p)
+		{
+			if (!old)
+				wasm_memory.allocations++;
+			wasm_memory.used += (double)malloc_usable_size(p) - old_size;
+			if (wasm_memory.used > wasm_memory.peak)
+				wasm_memory.peak = wasm_memory.used;
+		}
+	}
+	wasm_memory_unlock();
+	return p;
+}
+
+static void wasm_alloc_free(void *user, void *p)
+{
+	wasm_memory_lock();
+	if (p)
+		wasm_memory.used -= malloc_usable_size(p);
+	free(p);
+	wasm_memory_unlock();
+}
+
+static fz_alloc_context wasm_alloc = { NULL, wasm_alloc_malloc, wasm_alloc_realloc, wasm_alloc_free };
+
+static size_t wasm_store_size;
+static double out_memory_stats[6];
+
+// At most this many threads run jobs, counting the calling thread. The
+// pthread pool only has workers for the others (see build.sh).
+static int wasm_threads = WASM_MAX_THREADS;
+
+// Returns the store limit, memory limit, bytes used, peak bytes used,
+// number of allocations and number of allocations refused by the limit.
+EXPORT
+double *wasm_memory_stats(void)
+{
+	wasm_memory_lock();
+	out_memory_stats[0] = wasm_store_size;
+	out_memory_stats[1] = wasm_memory.limit;
+	out_memory_stats[2] = wasm_memory.used;
+	out_memory_stats[3] = wasm_memory.peak;
+	out_memory_stats[4] = wasm_memory.allocations;
+	out_memory_stats[5] = wasm_memory.failed;
+	wasm_memory_unlock();
+	return out_memory_stats;
+}
+
+EXPORT
+void wasm_set_memory_limit(double limit)
+{
+	wasm_memory_lock();
+	wasm_memory.limit = limit;
+	wasm_memory_unlock();
+}
+
+EXPORT
+void wasm_reset_memory_peak(void)
+{
+	wasm_memory_lock();
+	wasm_memory.peak = wasm_memory.used;
+	wasm_memory_unlock();
+}
+
+// Drop items from the resource store until it is at most percent full.
+EXPORT
+int wasm_shrink_store(int percent)
+{
+	INTEGER(fz_shrink_store, percent)
+}
+
+EXPORT
+void wasm_empty_store(void)
+{
+	fz_empty_store(ctx);
+}
+
+// Write the items in the resource store, for debugging.
+EXPORT
+fz_buffer *wasm_debug_store(void)
+{
+	fz_buffer *buf = NULL;
+	fz_output *out = NULL;
+	fz_var(buf);
+	fz_var(out);
+	fz_try(ctx)
+	{
+		buf = fz_new_buffer(ctx, 4096);
+		out = fz_new_output_with_buffer(ctx, buf);
+		fz_debug_store(ctx, out);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+		fz_drop_output(ctx, out);
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		wasm_rethrow(ctx);
+	}
+	return buf;
+}
+
+static int handlers_registered = 0;
+
+// With lazy_handlers set, the document handlers are registered when the
+// first document is opened instead.
+static void register_document_handlers(fz_context *ctx)
+{
+	if (!handlers_registered)
+	{
+		fz_register_document_handlers(ctx);
+		handlers_registered = 1;
+	}
+}
+
 EXPORT
-void wasm_init_context(void)
+void wasm_init_context(int lazy_handlers, double store_size, double memory_limit, int threads)
 {
-	ctx = fz_new_context(NULL, NULL, 100<<20);
+	wasm_store_size = store_size;
+	wasm_memory.limit = memory_limit;
+	if (threads > 0 && threads < wasm_threads)
+		wasm_threads = threads;
+#ifdef __EMSCRIPTEN_PTHREADS__
+	int i;
+	for (i = 0; i < FZ_LOCK_MAX; ++i)
+		pthread_mutex_init(&wasm_mutexes[i], NULL);
+	ctx = fz_new_context(&wasm_alloc, &wasm_locks, wasm_store_size);
+#else
+	ctx = fz_new_context(&wasm_alloc, NULL, wasm_store_size);
+#endif
 	if (!ctx)
 		EM_ASM({ throw new Error("Cannot create MuPDF context!"); });
-	fz_register_document_handlers(ctx);
+	if (!lazy_handlers)
+		register_document_handlers(ctx);
 }
 
 EXPORT
@@ -86,6 +313,93 @@ void wasm_free(void *p)
 	fz_free(ctx, p);
 }
 
+// --- THREADS ---
+
+// Run a batch of independent jobs, spread over as many threads as we have.
+// Each thread gets its own cloned context; the calling thread takes part too.
+
+typedef void (wasm_job_fn)(fz_context *ctx, void *arg, int i);
+
+struct wasm_jobs
+{
+	fz_context *ctx;
+	wasm_job_fn *fn;
+	void *arg;
+	int count;
+	int next;
+	int errors;
+};
+
+static void run_jobs_with_context(fz_context *ctx, struct wasm_jobs *jobs)
+{
+	int i;
+	while ((i = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_SEQ_CST)) < jobs->count)
+	{
+		fz_try(ctx)
+			jobs->fn(ctx, jobs->arg, i);
+		fz_catch(ctx)
+		{
+			fz_warn(ctx, "job %d failed: %s", i, fz_caught_message(ctx));
+			__atomic_fetch_add(&jobs->errors, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+}
+
+#ifdef __EMSCRIPTEN_PTHREADS__
+static void *run_jobs_thread(void *jobs_)
+{
+	struct wasm_jobs *jobs = jobs_;
+	fz_context *ctx = fz_clone_context(jobs->ctx);
+	if (ctx)
+	{
+		run_jobs_with_context(ctx, jobs);
+		fz_drop_context(ctx);
+	}
+	return NULL;
+}
+#endif
+
+static void run_jobs(wasm_job_fn *fn, void *arg, int count)
+{
+	struct wasm_jobs jobs = { ctx, fn, arg, count, 0, 0 };
+#ifdef __EMSCRIPTEN_PTHREADS__
+	pthread_t threads[WASM_MAX_THREADS];
+	int i, n;
+
+	n = emscripten_num_logical_cores();
+	if (n > wasm_threads)
+		n = wasm_threads;
+	if (n > count)
+		n = count;
+
+	// The calling thread is one of the n workers.
+	for (i = 0; i < n - 1; ++i)
+		if (pthread_create(&threads[i], NULL, run_jobs_thread, &jobs))
+			break;
+	n = i;
+
+	run_jobs_with_context(ctx, &jobs);
+
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+#else
+	run_jobs_with_context(ctx, &jobs);
+#endif
+	if (jobs.errors)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "%d of %d jobs failed", jobs.errors, count);
+}
+
+EXPORT
+int wasm_thread_count(void)
+{
+#ifdef __EMSCRIPTEN_PTHREADS__
+	int n = emscripten_num_logical_cores();
+	return n < wasm_threads ? n : wasm_threads;
+#else
+	return 1;
+#endif
+}
+
 // --- REFERENCE COUNTING ---
 
 #define KEEP_(WNAME,FNAME) EXPORT void * WNAME(void *p) { return FNAME(ctx, p); }
@@ -115,6 +429,7 @@ REFS(device)
 REFS(display_list)
 DROP(stext_page)
 DROP(document_writer)
+DROP(output)
 
 REFS(document)
 REFS(page)
@@ -138,6 +453,8 @@ PDF_REFS(obj)
 GET(buffer, void*, data)
 GET(buffer, int, len)
 
+GET(stream, void*, state)
+
 GET(colorspace, int, type)
 GET(colorspace, int, n)
 GET(colorspace, char*, name)
@@ -207,6 +524,12 @@ GETP(stext_char, fz_quad, quad)
 GET(stext_char, float, size)
 GET(stext_char, fz_font*, font)
 
+GETSET(cookie, int, abort)
+GET(cookie, int, progress)
+GET(cookie, int, progress_max)
+GET(cookie, int, errors)
+GET(cookie, int, incomplete)
+
 PDF_GET(embedded_file_params, const char*, filename)
 PDF_GET(embedded_file_params, const char*, mimetype)
 PDF_GET(embedded_file_params, int, size)
@@ -245,6 +568,20 @@ void wasm_append_buffer(fz_buffer *buf, fz_buffer *src)
 	VOID(fz_append_buffer, buf, src)
 }
 
+// --- Cookie ---
+
+EXPORT
+fz_cookie * wasm_new_cookie(void)
+{
+	POINTER(fz_malloc_struct, fz_cookie)
+}
+
+EXPORT
+void wasm_free_cookie(fz_cookie *cookie)
+{
+	fz_free(ctx, cookie);
+}
+
 // --- ColorSpace ---
 
 EXPORT fz_colorspace * wasm_device_gray(void) { return fz_device_gray(ctx); }
@@ -268,111 +605,891 @@ fz_stroke_state * wasm_new_stroke_state(void)
 // --- Pixmap ---
 
 EXPORT
-fz_pixmap * wasm_get_pixmap_from_image(fz_image *image)
+fz_pixmap * wasm_get_pixmap_from_image(fz_image *image)
+{
+	POINTER(fz_get_pixmap_from_image, image, NULL, NULL, NULL, NULL)
+}
+
+// The fz_new_pixmap_from_page and fz_new_stext_page_from_* functions do not
+// take a cookie, so we do the same work here with one.
+
+static fz_pixmap *new_pixmap_from_page(fz_context *ctx, fz_page *page, int contents_only, fz_matrix ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
+{
+	fz_irect bbox = fz_round_rect(fz_transform_rect(fz_bound_page(ctx, page), ctm));
+	fz_pixmap *pix;
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	pix = fz_new_pixmap_with_bbox(ctx, colorspace, bbox, NULL, alpha);
+	fz_try(ctx)
+	{
+		if (alpha)
+			fz_clear_pixmap(ctx, pix);
+		else
+			fz_clear_pixmap_with_value(ctx, pix, 0xFF);
+		dev = fz_new_draw_device(ctx, ctm, pix);
+		if (contents_only)
+			fz_run_page_contents(ctx, page, dev, fz_identity, cookie);
+		else
+			fz_run_page(ctx, page, dev, fz_identity, cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+	return pix;
+}
+
+static fz_stext_page *new_stext_page(fz_context *ctx, fz_page *page, fz_display_list *list, fz_stext_options *options, fz_cookie *cookie)
+{
+	fz_stext_page *text;
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	text = fz_new_stext_page(ctx, page ? fz_bound_page(ctx, page) : fz_bound_display_list(ctx, list));
+	fz_try(ctx)
+	{
+		dev = fz_new_stext_device(ctx, text, options);
+		if (page)
+			fz_run_page_contents(ctx, page, dev, fz_identity, cookie);
+		else
+			fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_stext_page(ctx, text);
+		fz_rethrow(ctx);
+	}
+	return text;
+}
+
+EXPORT
+fz_pixmap * wasm_new_pixmap_from_page(fz_page *page, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
+{
+	POINTER(new_pixmap_from_page, page, 0, *ctm, colorspace, alpha, cookie)
+}
+
+EXPORT
+fz_pixmap * wasm_new_pixmap_from_page_contents(fz_page *page, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
+{
+	POINTER(new_pixmap_from_page, page, 1, *ctm, colorspace, alpha, cookie)
+}
+
+EXPORT
+fz_pixmap * wasm_new_pixmap_with_bbox(fz_colorspace *colorspace, fz_rect *bbox, int alpha)
+{
+	POINTER(fz_new_pixmap_with_bbox, colorspace, fz_irect_from_rect(*bbox), NULL, alpha)
+}
+
+static fz_pixmap *new_pixmap_with_bbox_and_data(fz_context *ctx, fz_colorspace *colorspace, fz_irect bbox, int alpha, unsigned char *samples, int capacity)
+{
+	int n = fz_colorspace_n(ctx, colorspace) + alpha;
+	int w = bbox.x1 - bbox.x0;
+	int h = bbox.y1 - bbox.y0;
+	if ((size_t)w * h * n > (size_t)capacity)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "pixmap data buffer too small");
+	return fz_new_pixmap_with_bbox_and_data(ctx, colorspace, bbox, NULL, alpha, samples);
+}
+
+// The samples are owned by the caller and must outlive the pixmap.
+EXPORT
+fz_pixmap * wasm_new_pixmap_with_bbox_and_data(fz_colorspace *colorspace, fz_rect *bbox, int alpha, unsigned char *samples, int capacity)
+{
+	POINTER(new_pixmap_with_bbox_and_data, colorspace, fz_irect_from_rect(*bbox), alpha, samples, capacity)
+}
+
+EXPORT
+void wasm_clear_pixmap(fz_pixmap *pix)
+{
+	VOID(fz_clear_pixmap, pix)
+}
+
+EXPORT
+void wasm_clear_pixmap_with_value(fz_pixmap *pix, int value)
+{
+	VOID(fz_clear_pixmap_with_value, pix, value)
+}
+
+#ifdef __wasm_simd128__
+
+// SIMD versions of the pixmap filters, for the common case of plain Gray,
+// RGB or BGR pixmaps without alpha or spots. Unless noted they give the
+// same results as the scalar versions in fitz, which handle everything else.
+
+static int is_simple_pixmap(fz_pixmap *pix)
+{
+	switch (fz_colorspace_type(ctx, pix->colorspace))
+	{
+	case FZ_COLORSPACE_GRAY:
+	case FZ_COLORSPACE_RGB:
+	case FZ_COLORSPACE_BGR:
+		return pix->alpha == 0 && pix->s == 0;
+	default:
+		return 0;
+	}
+}
+
+static void invert_pixmap_simd(fz_pixmap *pix)
+{
+	size_t len = (size_t)pix->w * pix->n;
+	unsigned char *row = pix->samples;
+	int y;
+	for (y = 0; y < pix->h; ++y, row += pix->stride)
+	{
+		size_t x = 0;
+		for (; x + 16 <= len; x += 16)
+			wasm_v128_store(row + x, wasm_v128_not(wasm_v128_load(row + x)));
+		for (; x < len; ++x)
+			row[x] = 255 - row[x];
+	}
+}
+
+// s = black + fz_mul255(s, white - black) for each component, computed in
+// 32-bit lanes since the product needs 17 bits. For RGB the components
+// repeat every 48 bytes, so lane constants are kept for one such period.
+static void tint_pixmap_simd(fz_pixmap *pix, int black, int white)
+{
+	int32_t base[48], delta[48];
+	int b[3] = { (black >> 16) & 255, (black >> 8) & 255, black & 255 };
+	int w[3] = { (white >> 16) & 255, (white >> 8) & 255, white & 255 };
+	size_t len = (size_t)pix->w * 3;
+	unsigned char *row = pix->samples;
+	int i, y;
+
+	if (fz_colorspace_type(ctx, pix->colorspace) == FZ_COLORSPACE_BGR)
+	{
+		int t = b[0]; b[0] = b[2]; b[2] = t;
+		t = w[0]; w[0] = w[2]; w[2] = t;
+	}
+	for (i = 0; i < 48; ++i)
+	{
+		base[i] = b[i % 3];
+		delta[i] = w[i % 3] - b[i % 3];
+	}
+
+	for (y = 0; y < pix->h; ++y, row += pix->stride)
+	{
+		size_t x = 0;
+		for (; x + 16 <= len; x += 16)
+		{
+			int k = x % 48;
+			v128_t v = wasm_v128_load(row + x);
+			v128_t lo = wasm_u16x8_extend_low_u8x16(v);
+			v128_t hi = wasm_u16x8_extend_high_u8x16(v);
+			v128_t r[4] = {
+				wasm_u32x4_extend_low_u16x8(lo),
+				wasm_u32x4_extend_high_u16x8(lo),
+				wasm_u32x4_extend_low_u16x8(hi),
+				wasm_u32x4_extend_high_u16x8(hi),
+			};
+			for (i = 0; i < 4; ++i)
+			{
+				v128_t t = wasm_i32x4_add(wasm_i32x4_mul(r[i], wasm_v128_load(delta + k + i * 4)), wasm_i32x4_splat(128));
+				t = wasm_i32x4_shr(wasm_i32x4_add(t, wasm_i32x4_shr(t, 8)), 8);
+				r[i] = wasm_i32x4_add(t, wasm_v128_load(base + k + i * 4));
+			}
+			wasm_v128_store(row + x, wasm_u8x16_narrow_i16x8(
+				wasm_i16x8_narrow_i32x4(r[0], r[1]),
+				wasm_i16x8_narrow_i32x4(r[2], r[3])));
+		}
+		for (; x < len; ++x)
+			row[x] = base[x % 3] + fz_mul255(row[x], delta[x % 3]);
+	}
+}
+
+// Moves bytes within blocks of up to four vectors, out[j] = in[src(j)].
+// Each output vector is the union of a swizzle of every input vector, since
+// lanes with an index out of range come out as zero.
+struct shuffle
+{
+	int in, out;
+	v128_t mask[4][4];
+};
+
+static int planar_rgb(int j) { return 3 * (j % 16) + j / 16; }
+static int rgba_to_rgb(int j) { return 4 * (j / 3) + j % 3; }
+static int gray_to_rgb(int j) { return j / 3; }
+
+static void init_shuffle(struct shuffle *sh, int in, int out, int (*src)(int))
+{
+	unsigned char m[16];
+	int i, j, k;
+	sh->in = in;
+	sh->out = out;
+	for (i = 0; i < out; ++i)
+	{
+		for (k = 0; k < in; ++k)
+		{
+			for (j = 0; j < 16; ++j)
+			{
+				int s = src(i * 16 + j);
+				m[j] = s / 16 == k ? s % 16 : 0x80;
+			}
+			sh->mask[i][k] = wasm_v128_load(m);
+		}
+	}
+}
+
+static void shuffle(const struct shuffle *sh, const unsigned char *s, v128_t *out)
+{
+	v128_t in[4];
+	int i, k;
+	for (k = 0; k < sh->in; ++k)
+		in[k] = wasm_v128_load(s + k * 16);
+	for (i = 0; i < sh->out; ++i)
+	{
+		out[i] = wasm_i8x16_swizzle(in[0], sh->mask[i][0]);
+		for (k = 1; k < sh->in; ++k)
+			out[i] = wasm_v128_or(out[i], wasm_i8x16_swizzle(in[k], sh->mask[i][k]));
+	}
+}
+
+// fz_gamma_pixmap maps every component through a table of 256 entries,
+// which is looked up 16 entries at a time with one swizzle each.
+static void gamma_pixmap_simd(fz_pixmap *pix, float gamma)
+{
+	unsigned char map[256];
+	v128_t table[16];
+	size_t len = (size_t)pix->w * pix->n;
+	unsigned char *row = pix->samples;
+	int k, y;
+
+	for (k = 0; k < 256; ++k)
+		map[k] = pow(k / 255.0f, gamma) * 255;
+	for (k = 0; k < 16; ++k)
+		table[k] = wasm_v128_load(map + k * 16);
+
+	for (y = 0; y < pix->h; ++y, row += pix->stride)
+	{
+		size_t x = 0;
+		for (; x + 16 <= len; x += 16)
+		{
+			v128_t v = wasm_v128_load(row + x);
+			v128_t r = wasm_i8x16_swizzle(table[0], v);
+			for (k = 1; k < 16; ++k)
+				r = wasm_v128_or(r, wasm_i8x16_swizzle(table[k], wasm_i8x16_sub(v, wasm_i8x16_splat(k * 16))));
+			wasm_v128_store(row + x, r);
+		}
+		for (; x < len; ++x)
+			row[x] = map[row[x]];
+	}
+}
+
+enum { DROP_ALPHA, RGB_TO_GRAY, GRAY_TO_RGB };
+
+// Dropping the alpha of RGB or BGR, which keeps the premultiplied
+// components as they are and so composites the pixmap over black. When
+// ICC is disabled, also the fast conversions in fitz between Gray and RGB
+// or BGR. Returns NULL, for fz_convert_pixmap, for anything else.
+static fz_pixmap *convert_pixmap_simd(fz_pixmap *pix, fz_colorspace *colorspace, int keep_alpha)
+{
+	enum fz_colorspace_type st = fz_colorspace_type(ctx, pix->colorspace);
+	enum fz_colorspace_type dt = fz_colorspace_type(ctx, colorspace);
+	int src_rgb = st == FZ_COLORSPACE_RGB || st == FZ_COLORSPACE_BGR;
+	int w[3] = { 77, 150, 28 };
+	struct shuffle sh;
+	unsigned char *s, *d;
+	fz_pixmap *dst;
+	int mode, y, i;
+
+	if (pix->s != 0 || (pix->alpha && keep_alpha))
+		return NULL;
+	if (pix->alpha && src_rgb && colorspace == pix->colorspace)
+		mode = DROP_ALPHA;
+	else if (!FZ_ENABLE_ICC && !pix->alpha && src_rgb && dt == FZ_COLORSPACE_GRAY)
+		mode = RGB_TO_GRAY;
+	else if (!FZ_ENABLE_ICC && !pix->alpha && st == FZ_COLORSPACE_GRAY && (dt == FZ_COLORSPACE_RGB || dt == FZ_COLORSPACE_BGR))
+		mode = GRAY_TO_RGB;
+	else
+		return NULL;
+
+	if (st == FZ_COLORSPACE_BGR)
+	{
+		w[0] = 28;
+		w[2] = 77;
+	}
+	if (mode == DROP_ALPHA)
+		init_shuffle(&sh, 4, 3, rgba_to_rgb);
+	else if (mode == RGB_TO_GRAY)
+		init_shuffle(&sh, 3, 3, planar_rgb);
+	else
+		init_shuffle(&sh, 1, 3, gray_to_rgb);
+
+	dst = fz_new_pixmap(ctx, colorspace, pix->w, pix->h, NULL, 0);
+	dst->x = pix->x;
+	dst->y = pix->y;
+	fz_set_pixmap_resolution(ctx, dst, pix->xres, pix->yres);
+	dst->flags = (dst->flags & ~FZ_PIXMAP_FLAG_INTERPOLATE) | (pix->flags & FZ_PIXMAP_FLAG_INTERPOLATE);
+
+	s = pix->samples;
+	d = dst->samples;
+	for (y = 0; y < pix->h; ++y, s += pix->stride, d += dst->stride)
+	{
+		int x = 0;
+		for (; x + 16 <= pix->w; x += 16)
+		{
+			v128_t v[3];
+			shuffle(&sh, s + x * pix->n, v);
+			if (mode == RGB_TO_GRAY)
+			{
+				// ((r + 1) * 77 + (g + 1) * 150 + (b + 1) * 28) >> 8 fits
+				// in 16 bits.
+				v128_t lo = wasm_i16x8_splat(0), hi = wasm_i16x8_splat(0);
+				for (i = 0; i < 3; ++i)
+				{
+					v128_t one = wasm_i16x8_splat(1), k = wasm_i16x8_splat(w[i]);
+					lo = wasm_i16x8_add(lo, wasm_i16x8_mul(wasm_i16x8_add(wasm_u16x8_extend_low_u8x16(v[i]), one), k));
+					hi = wasm_i16x8_add(hi, wasm_i16x8_mul(wasm_i16x8_add(wasm_u16x8_extend_high_u8x16(v[i]), one), k));
+				}
+				wasm_v128_store(d + x, wasm_u8x16_narrow_i16x8(wasm_u16x8_shr(lo, 8), wasm_u16x8_shr(hi, 8)));
+			}
+			else
+			{
+				for (i = 0; i < 3; ++i)
+					wasm_v128_store(d + x * 3 + i * 16, v[i]);
+			}
+		}
+		for (; x < pix->w; ++x)
+		{
+			unsigned char *p = s + x * pix->n;
+			if (mode == RGB_TO_GRAY)
+				d[x] = ((p[0] + 1) * w[0] + (p[1] + 1) * w[1] + (p[2] + 1) * w[2]) >> 8;
+			else
+				for (i = 0; i < 3; ++i)
+					d[x * 3 + i] = mode == DROP_ALPHA ? p[i] : p[0];
+		}
+	}
+
+	return dst;
+}
+
+#endif
+
+EXPORT
+void wasm_invert_pixmap(fz_pixmap *pix)
+{
+#ifdef __wasm_simd128__
+	if (is_simple_pixmap(pix))
+	{
+		invert_pixmap_simd(pix);
+		return;
+	}
+#endif
+	VOID(fz_invert_pixmap, pix)
+}
+
+EXPORT
+void wasm_invert_pixmap_luminance(fz_pixmap *pix)
+{
+	VOID(fz_invert_pixmap_luminance, pix)
+}
+
+EXPORT
+void wasm_gamma_pixmap(fz_pixmap *pix, float gamma)
+{
+#ifdef __wasm_simd128__
+	if (is_simple_pixmap(pix))
+	{
+		gamma_pixmap_simd(pix, gamma);
+		return;
+	}
+#endif
+	VOID(fz_gamma_pixmap, pix, gamma)
+}
+
+EXPORT
+void wasm_tint_pixmap(fz_pixmap *pix, int black_hex_color, int white_hex_color)
+{
+#ifdef __wasm_simd128__
+	if (is_simple_pixmap(pix) && pix->n == 3)
+	{
+		tint_pixmap_simd(pix, black_hex_color, white_hex_color);
+		return;
+	}
+#endif
+	VOID(fz_tint_pixmap, pix, black_hex_color, white_hex_color)
+}
+
+EXPORT
+fz_buffer * wasm_new_buffer_from_pixmap_as_png(fz_pixmap *pix)
+{
+	POINTER(fz_new_buffer_from_pixmap_as_png, pix, fz_default_color_params)
+}
+
+EXPORT
+fz_buffer * wasm_new_buffer_from_pixmap_as_jpeg(fz_pixmap *pix, int quality, int invert_cmyk)
+{
+	POINTER(fz_new_buffer_from_pixmap_as_jpeg, pix, fz_default_color_params, quality, invert_cmyk)
+}
+
+EXPORT
+fz_buffer * wasm_new_buffer_from_pixmap_as_pnm(fz_pixmap *pix)
+{
+	POINTER(fz_new_buffer_from_pixmap_as_pnm, pix, fz_default_color_params)
+}
+
+EXPORT
+fz_buffer * wasm_new_buffer_from_pixmap_as_pam(fz_pixmap *pix)
+{
+	POINTER(fz_new_buffer_from_pixmap_as_pam, pix, fz_default_color_params)
+}
+
+// Write a pixmap to an output, such as a JS output, without an intermediate
+// buffer holding the whole file. The output is closed when done.
+
+static void write_pixmap(fz_context *ctx, fz_output *out, fz_pixmap *pix, const char *format, int quality, int invert_cmyk)
+{
+	if (!strcmp(format, "png"))
+		fz_write_pixmap_as_png(ctx, out, pix);
+	else if (!strcmp(format, "jpeg") || !strcmp(format, "jpg"))
+		fz_write_pixmap_as_jpeg(ctx, out, pix, quality, invert_cmyk);
+	else if (!strcmp(format, "pnm"))
+		fz_write_pixmap_as_pnm(ctx, out, pix);
+	else if (!strcmp(format, "pam"))
+		fz_write_pixmap_as_pam(ctx, out, pix);
+	else
+		fz_throw(ctx, FZ_ERROR_GENERIC, "unknown image format: %s", format);
+	fz_close_output(ctx, out);
+}
+
+EXPORT
+void wasm_write_pixmap(fz_output *out, fz_pixmap *pix, char *format, int quality, int invert_cmyk)
+{
+	VOID(write_pixmap, out, pix, format, quality, invert_cmyk)
+}
+
+// Render a page or display list in bands of band_height rows, and pass each
+// band to a band writer as soon as it is drawn, so that only one band is
+// ever in memory however large the image is. A page is recorded into a
+// display list first, so that it is only interpreted once. The output is
+// closed when done.
+
+static fz_band_writer *new_band_writer(fz_context *ctx, fz_output *out, const char *format, const char *options)
+{
+	if (!strcmp(format, "png"))
+		return fz_new_png_band_writer(ctx, out);
+	if (!strcmp(format, "pnm"))
+		return fz_new_pnm_band_writer(ctx, out);
+	if (!strcmp(format, "pam"))
+		return fz_new_pam_band_writer(ctx, out);
+	if (!strcmp(format, "pwg"))
+	{
+		fz_pwg_options pwg;
+		memset(&pwg, 0, sizeof pwg);
+		fz_write_pwg_file_header(ctx, out);
+		return fz_new_pwg_band_writer(ctx, out, &pwg);
+	}
+	if (!strcmp(format, "pclm"))
+	{
+		fz_pclm_options pclm;
+		fz_parse_pclm_options(ctx, &pclm, options);
+		return fz_new_pclm_band_writer(ctx, out, &pclm);
+	}
+	fz_throw(ctx, FZ_ERROR_GENERIC, "unknown band format: %s", format);
+}
+
+static void write_banded(fz_context *ctx, fz_output *out, fz_page *page, int contents_only, fz_display_list *list,
+	fz_matrix ctm, fz_colorspace *colorspace, int alpha, int band_height, int resolution,
+	const char *format, const char *options, fz_cookie *cookie)
+{
+	fz_rect bounds = page ? fz_bound_page(ctx, page) : fz_bound_display_list(ctx, list);
+	fz_irect bbox = fz_round_rect(fz_transform_rect(bounds, ctm));
+	int w = bbox.x1 - bbox.x0;
+	int h = bbox.y1 - bbox.y0;
+	fz_display_list *page_list = NULL;
+	fz_band_writer *writer = NULL;
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+	int y;
+
+	fz_var(page_list);
+	fz_var(writer);
+	fz_var(pix);
+	fz_var(dev);
+
+	if (w <= 0 || h <= 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write an empty image");
+	if (band_height <= 0 || band_height > h)
+		band_height = h;
+
+	fz_try(ctx)
+	{
+		if (page)
+		{
+			if (contents_only)
+				page_list = fz_new_display_list_from_page_contents(ctx, page);
+			else
+				page_list = fz_new_display_list_from_page(ctx, page);
+			list = page_list;
+		}
+
+		writer = new_band_writer(ctx, out, format, options);
+		fz_write_header(ctx, writer, w, h, fz_colorspace_n(ctx, colorspace) + alpha, alpha, resolution, resolution, 0, colorspace, NULL);
+
+		pix = fz_new_pixmap(ctx, colorspace, w, band_height, NULL, alpha);
+		fz_set_pixmap_resolution(ctx, pix, resolution, resolution);
+		pix->x = bbox.x0;
+
+		for (y = 0; y < h; y += band_height)
+		{
+			if (cookie && cookie->abort)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "rendering aborted");
+
+			// The last band may be shorter.
+			pix->y = bbox.y0 + y;
+			pix->h = fz_mini(band_height, h - y);
+			if (alpha)
+				fz_clear_pixmap(ctx, pix);
+			else
+				fz_clear_pixmap_with_value(ctx, pix, 0xFF);
+
+			dev = fz_new_draw_device(ctx, fz_identity, pix);
+			fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(fz_pixmap_bbox(ctx, pix)), cookie);
+			fz_close_device(ctx, dev);
+			fz_drop_device(ctx, dev);
+			dev = NULL;
+
+			// An abort stops the band part way, so do not write it.
+			if (cookie && cookie->abort)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "rendering aborted");
+
+			fz_write_band(ctx, writer, pix->stride, pix->h, pix->samples);
+		}
+
+		fz_close_band_writer(ctx, writer);
+		fz_close_output(ctx, out);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_device(ctx, dev);
+		fz_drop_pixmap(ctx, pix);
+		fz_drop_band_writer(ctx, writer);
+		fz_drop_display_list(ctx, page_list);
+	}
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+}
+
+EXPORT
+void wasm_write_banded_page(fz_output *out, fz_page *page, int contents_only, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, int band_height, int resolution, char *format, char *options, fz_cookie *cookie)
+{
+	VOID(write_banded, out, page, contents_only, NULL, *ctm, colorspace, alpha, band_height, resolution, format, options, cookie)
+}
+
+EXPORT
+void wasm_write_banded_display_list(fz_output *out, fz_display_list *list, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, int band_height, int resolution, char *format, char *options, fz_cookie *cookie)
+{
+	VOID(write_banded, out, NULL, 0, list, *ctm, colorspace, alpha, band_height, resolution, format, options, cookie)
+}
+
+static fz_pixmap *convert_pixmap(fz_context *ctx, fz_pixmap *pixmap, fz_colorspace *colorspace, int keep_alpha)
+{
+#ifdef __wasm_simd128__
+	fz_pixmap *pix = convert_pixmap_simd(pixmap, colorspace, keep_alpha);
+	if (pix)
+		return pix;
+#endif
+	return fz_convert_pixmap(ctx, pixmap, colorspace, NULL, NULL, fz_default_color_params, keep_alpha);
+}
+
+EXPORT
+fz_pixmap * wasm_convert_pixmap(fz_pixmap *pixmap, fz_colorspace *colorspace, int keep_alpha)
+{
+	POINTER(convert_pixmap, pixmap, colorspace, keep_alpha)
+}
+
+// --- Shade ---
+
+EXPORT
+fz_rect * wasm_bound_shade(fz_shade *shade)
+{
+	RECT(fz_bound_shade, shade, fz_identity)
+}
+
+// --- DisplayList ---
+
+EXPORT
+fz_display_list * wasm_new_display_list(fz_rect *mediabox)
+{
+	POINTER(fz_new_display_list, *mediabox)
+}
+
+EXPORT
+fz_rect * wasm_bound_display_list(fz_display_list *list)
+{
+	RECT(fz_bound_display_list, list)
+}
+
+EXPORT
+void wasm_run_display_list(fz_display_list *display_list, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
+{
+	VOID(fz_run_display_list, display_list, dev, *ctm, fz_infinite_rect, cookie)
+}
+
+EXPORT
+int wasm_search_display_list(fz_display_list *display_list, const char *needle, int *marks, fz_quad *hit_bbox, int hit_max)
+{
+	INTEGER(fz_search_display_list, display_list, needle, marks, hit_bbox, hit_max)
+}
+
+static fz_pixmap *new_pixmap_tile_from_display_list(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_colorspace *colorspace, int alpha, fz_irect tile, fz_cookie *cookie)
+{
+	fz_pixmap *pix;
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	pix = fz_new_pixmap_with_bbox(ctx, colorspace, tile, NULL, alpha);
+	fz_try(ctx)
+	{
+		if (alpha)
+			fz_clear_pixmap(ctx, pix);
+		else
+			fz_clear_pixmap_with_value(ctx, pix, 0xFF);
+		dev = fz_new_draw_device(ctx, fz_identity, pix);
+		fz_run_display_list(ctx, list, dev, ctm, fz_rect_from_irect(tile), cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+	return pix;
+}
+
+EXPORT
+fz_pixmap * wasm_new_pixmap_from_display_list(fz_display_list *display_list, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
 {
-	POINTER(fz_get_pixmap_from_image, image, NULL, NULL, NULL, NULL)
+	fz_pixmap *pix;
+	TRY({
+		fz_irect bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, display_list), *ctm));
+		pix = new_pixmap_tile_from_display_list(ctx, display_list, *ctm, colorspace, alpha, bbox, cookie);
+	})
+	return pix;
 }
 
 EXPORT
-fz_pixmap * wasm_new_pixmap_from_page(fz_page *page, fz_matrix *ctm, fz_colorspace *colorspace, int alpha)
+fz_pixmap * wasm_new_pixmap_tile_from_display_list(fz_display_list *display_list, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_irect *tile, fz_cookie *cookie)
 {
-	POINTER(fz_new_pixmap_from_page, page, *ctm, colorspace, alpha)
+	POINTER(new_pixmap_tile_from_display_list, display_list, *ctm, colorspace, alpha, *tile, cookie)
 }
 
-EXPORT
-fz_pixmap * wasm_new_pixmap_with_bbox(fz_colorspace *colorspace, fz_rect *bbox, int alpha)
+// The jobs below share one cookie, so aborting it stops them all; its
+// progress counts are not exact when they run on several threads.
+struct pixmaps_from_display_lists
 {
-	POINTER(fz_new_pixmap_with_bbox, colorspace, fz_irect_from_rect(*bbox), NULL, alpha)
-}
+	fz_display_list **lists;
+	fz_matrix ctm;
+	fz_colorspace *colorspace;
+	int alpha;
+	fz_cookie *cookie;
+	fz_pixmap **out;
+};
 
-EXPORT
-void wasm_clear_pixmap(fz_pixmap *pix)
+static void pixmap_from_display_list_job(fz_context *ctx, void *arg, int i)
 {
-	VOID(fz_clear_pixmap, pix)
+	struct pixmaps_from_display_lists *job = arg;
+	fz_irect bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, job->lists[i]), job->ctm));
+	job->out[i] = new_pixmap_tile_from_display_list(ctx, job->lists[i], job->ctm, job->colorspace, job->alpha, bbox, job->cookie);
 }
 
 EXPORT
-void wasm_clear_pixmap_with_value(fz_pixmap *pix, int value)
+void wasm_new_pixmaps_from_display_lists(fz_display_list **lists, int count, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie, fz_pixmap **out)
 {
-	VOID(fz_clear_pixmap_with_value, pix, value)
+	struct pixmaps_from_display_lists job = { lists, *ctm, colorspace, alpha, cookie, out };
+	int i;
+	memset(out, 0, count * sizeof *out);
+	fz_try(ctx)
+		run_jobs(pixmap_from_display_list_job, &job, count);
+	fz_catch(ctx)
+	{
+		for (i = 0; i < count; ++i)
+		{
+			fz_drop_pixmap(ctx, out[i]);
+			out[i] = NULL;
+		}
+		wasm_rethrow(ctx);
+	}
 }
 
-EXPORT
-void wasm_invert_pixmap(fz_pixmap *pix)
+// Thumbnails fit the page into max_w by max_h pixels, and leave out
+// annotations and widgets. Images are drawn from the smallest subsampled
+// level that still covers their size on the thumbnail, since the draw
+// device asks fz_get_pixmap_from_image for only the area and size it needs.
+// A scanned page is therefore decoded at an eighth of its resolution or less.
+
+static fz_matrix thumbnail_matrix(fz_rect bounds, int max_w, int max_h)
 {
-	VOID(fz_invert_pixmap, pix)
+	float w = bounds.x1 - bounds.x0;
+	float h = bounds.y1 - bounds.y0;
+	float scale = 1;
+	if (w > 0 && h > 0)
+		scale = fz_min(max_w / w, max_h / h);
+	return fz_scale(scale, scale);
 }
 
-EXPORT
-void wasm_invert_pixmap_luminance(fz_pixmap *pix)
+// Record the contents of a page, and the matrix that fits it in a thumbnail.
+static fz_display_list *new_thumbnail_list(fz_context *ctx, fz_page *page, int max_w, int max_h, fz_matrix *ctm)
 {
-	VOID(fz_invert_pixmap_luminance, pix)
+	*ctm = thumbnail_matrix(fz_bound_page(ctx, page), max_w, max_h);
+	return fz_new_display_list_from_page_contents(ctx, page);
 }
 
-EXPORT
-void wasm_gamma_pixmap(fz_pixmap *pix, float gamma)
+static fz_pixmap *new_thumbnail(fz_context *ctx, fz_page *page, int max_w, int max_h, fz_colorspace *colorspace)
 {
-	VOID(fz_gamma_pixmap, pix, gamma)
+	fz_matrix ctm;
+	fz_display_list *list = new_thumbnail_list(ctx, page, max_w, max_h, &ctm);
+	fz_pixmap *pix = NULL;
+	fz_try(ctx)
+		pix = fz_new_pixmap_from_display_list(ctx, list, ctm, colorspace, 0);
+	fz_always(ctx)
+		fz_drop_display_list(ctx, list);
+	fz_catch(ctx)
+		fz_rethrow(ctx);
+	return pix;
 }
 
 EXPORT
-void wasm_tint_pixmap(fz_pixmap *pix, int black_hex_color, int white_hex_color)
+fz_pixmap * wasm_new_thumbnail(fz_page *page, int max_w, int max_h, fz_colorspace *colorspace)
 {
-	VOID(fz_tint_pixmap, pix, black_hex_color, white_hex_color)
+	POINTER(new_thumbnail, page, max_w, max_h, colorspace)
 }
 
-EXPORT
-fz_buffer * wasm_new_buffer_from_pixmap_as_png(fz_pixmap *pix)
+struct thumbnails
 {
-	POINTER(fz_new_buffer_from_pixmap_as_png, pix, fz_default_color_params)
-}
+	fz_display_list **lists;
+	fz_matrix *ctms;
+	fz_colorspace *colorspace;
+	fz_pixmap **out;
+};
 
-EXPORT
-fz_pixmap * wasm_convert_pixmap(fz_pixmap *pixmap, fz_colorspace *colorspace, int keep_alpha)
+// A page that fails gets no thumbnail rather than failing the others.
+static void thumbnail_job(fz_context *ctx, void *arg, int i)
 {
-	POINTER(fz_convert_pixmap, pixmap, colorspace, NULL, NULL, fz_default_color_params, keep_alpha)
+	struct thumbnails *job = arg;
+	if (!job->lists[i])
+		return;
+	fz_try(ctx)
+		job->out[i] = fz_new_pixmap_from_display_list(ctx, job->lists[i], job->ctms[i], job->colorspace, 0);
+	fz_catch(ctx)
+		fz_warn(ctx, "cannot render thumbnail %d: %s", i, fz_caught_message(ctx));
 }
 
-// --- Shade ---
-
+// The pages are loaded one at a time, since only rendering can be done in
+// parallel, and their contents recorded into display lists that the threads
+// then render. Pages that cannot be loaded or rendered are left NULL in out,
+// except that if one has yet to be fetched, the whole call fails with
+// TRYLATER to be tried again.
 EXPORT
-fz_rect * wasm_bound_shade(fz_shade *shade)
+void wasm_new_thumbnails(fz_document *doc, int *pages, int count, int max_w, int max_h, fz_colorspace *colorspace, fz_pixmap **out)
 {
-	RECT(fz_bound_shade, shade, fz_identity)
-}
+	struct thumbnails job = { NULL, NULL, colorspace, out };
+	fz_page *page = NULL;
+	int i;
 
-// --- DisplayList ---
+	fz_var(page);
+	fz_var(i);
 
-EXPORT
-fz_display_list * wasm_new_display_list(fz_rect *mediabox)
-{
-	POINTER(fz_new_display_list, *mediabox)
+	memset(out, 0, count * sizeof *out);
+	fz_try(ctx)
+	{
+		job.lists = fz_calloc(ctx, count, sizeof *job.lists);
+		job.ctms = fz_malloc_array(ctx, count, fz_matrix);
+		for (i = 0; i < count; ++i)
+		{
+			fz_try(ctx)
+			{
+				page = fz_load_page(ctx, doc, pages[i]);
+				job.lists[i] = new_thumbnail_list(ctx, page, max_w, max_h, &job.ctms[i]);
+			}
+			fz_always(ctx)
+			{
+				fz_drop_page(ctx, page);
+				page = NULL;
+			}
+			fz_catch(ctx)
+			{
+				if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+					fz_rethrow(ctx);
+				fz_warn(ctx, "cannot load page %d for thumbnail: %s", pages[i], fz_caught_message(ctx));
+			}
+		}
+		run_jobs(thumbnail_job, &job, count);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_page(ctx, page);
+		if (job.lists)
+			for (i = 0; i < count; ++i)
+				fz_drop_display_list(ctx, job.lists[i]);
+		fz_free(ctx, job.lists);
+		fz_free(ctx, job.ctms);
+	}
+	fz_catch(ctx)
+	{
+		for (i = 0; i < count; ++i)
+		{
+			fz_drop_pixmap(ctx, out[i]);
+			out[i] = NULL;
+		}
+		wasm_rethrow(ctx);
+	}
 }
 
-EXPORT
-fz_rect * wasm_bound_display_list(fz_display_list *list)
+struct pixmap_tiles_from_display_list
 {
-	RECT(fz_bound_display_list, list)
-}
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_colorspace *colorspace;
+	int alpha;
+	fz_irect *tiles;
+	fz_cookie *cookie;
+	fz_pixmap **out;
+};
 
-EXPORT
-void wasm_run_display_list(fz_display_list *display_list, fz_device *dev, fz_matrix *ctm)
+static void pixmap_tile_from_display_list_job(fz_context *ctx, void *arg, int i)
 {
-	VOID(fz_run_display_list, display_list, dev, *ctm, fz_infinite_rect, NULL)
+	struct pixmap_tiles_from_display_list *job = arg;
+	job->out[i] = new_pixmap_tile_from_display_list(ctx, job->list, job->ctm, job->colorspace, job->alpha, job->tiles[i], job->cookie);
 }
 
 EXPORT
-fz_pixmap * wasm_new_pixmap_from_display_list(fz_display_list *display_list, fz_matrix *ctm, fz_colorspace *colorspace, int alpha)
+void wasm_new_pixmap_tiles_from_display_list(fz_display_list *display_list, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_irect *tiles, int count, fz_cookie *cookie, fz_pixmap **out)
 {
-	POINTER(fz_new_pixmap_from_display_list, display_list, *ctm, colorspace, alpha)
+	struct pixmap_tiles_from_display_list job = { display_list, *ctm, colorspace, alpha, tiles, cookie, out };
+	int i;
+	memset(out, 0, count * sizeof *out);
+	fz_try(ctx)
+		run_jobs(pixmap_tile_from_display_list_job, &job, count);
+	fz_catch(ctx)
+	{
+		for (i = 0; i < count; ++i)
+		{
+			fz_drop_pixmap(ctx, out[i]);
+			out[i] = NULL;
+		}
+		wasm_rethrow(ctx);
+	}
 }
 
 EXPORT
-fz_stext_page * wasm_new_stext_page_from_display_list(fz_display_list *display_list)
+fz_stext_page * wasm_new_stext_page_from_display_list(fz_display_list *display_list, fz_cookie *cookie)
 {
 	// TODO: parse options
 	fz_stext_options options = { FZ_STEXT_PRESERVE_SPANS };
-	POINTER(fz_new_stext_page_from_display_list, display_list, &options)
+	POINTER(new_stext_page, NULL, display_list, &options, cookie)
 }
 
 // --- Device ---
@@ -527,14 +1644,109 @@ void _wasm_end_layer(fz_device *dev)
 	VOID(fz_end_layer, dev)
 }
 
+// --- Output ---
+
+// An output that passes what is written to a JS sink (see Output in
+// mupdf.js), in chunks of the size given. The output buffers one chunk, so
+// that is all the memory it needs however much is written. Bytes before
+// skip are counted but not passed on; see pdf_write_document_update.
+
+struct js_output_state
+{
+	int id;
+	int64_t pos;
+	int64_t skip;
+};
+
+// The JS side returns the message of a sink that failed, for us to free.
+static void js_output_check(fz_context *ctx, char *error, const char *what)
+{
+	char message[256];
+	if (!error)
+		return;
+	fz_strlcpy(message, error, sizeof message);
+	fz_free(ctx, error);
+	fz_throw(ctx, FZ_ERROR_GENERIC, "cannot %s output: %s", what, message);
+}
+
+static void js_output_write(fz_context *ctx, void *opaque, const void *data, size_t n)
+{
+	struct js_output_state *state = opaque;
+	if (state->pos < state->skip)
+	{
+		size_t drop = state->skip - state->pos < (int64_t)n ? state->skip - state->pos : n;
+		data = (const unsigned char *)data + drop;
+		state->pos += drop;
+		n -= drop;
+		if (n == 0)
+			return;
+	}
+	js_output_check(ctx, (char *)EM_ASM_INT({ return libmupdf.outputWrite($0, $1, $2); }, state->id, data, n), "write to");
+	state->pos += n;
+}
+
+static int64_t js_output_tell(fz_context *ctx, void *opaque)
+{
+	struct js_output_state *state = opaque;
+	return state->pos;
+}
+
+static void js_output_close(fz_context *ctx, void *opaque)
+{
+	struct js_output_state *state = opaque;
+	js_output_check(ctx, (char *)EM_ASM_INT({ return libmupdf.outputClose($0); }, state->id), "close");
+}
+
+static void js_output_drop(fz_context *ctx, void *opaque)
+{
+	struct js_output_state *state = opaque;
+	EM_ASM({ libmupdf.outputDrop($0); }, state->id);
+	fz_free(ctx, state);
+}
+
+static fz_output *new_js_output(fz_context *ctx, int id, int chunk_size)
+{
+	struct js_output_state *state = fz_malloc_struct(ctx, struct js_output_state);
+	fz_output *out;
+	state->id = id;
+	fz_try(ctx)
+		out = fz_new_output(ctx, chunk_size, state, js_output_write, js_output_close, js_output_drop);
+	fz_catch(ctx)
+	{
+		fz_free(ctx, state);
+		fz_rethrow(ctx);
+	}
+	out->tell = js_output_tell;
+	return out;
+}
+
+EXPORT
+fz_output * wasm_new_js_output(int id, int chunk_size)
+{
+	POINTER(new_js_output, id, chunk_size)
+}
+
+EXPORT
+void wasm_close_output(fz_output *out)
+{
+	VOID(fz_close_output, out)
+}
+
 // --- DocumentWriter ---
 
 EXPORT
-fz_document_writer * wasm_new_document_writer(fz_buffer *buf, char *format, char *options)
+fz_document_writer * wasm_new_document_writer_with_buffer(fz_buffer *buf, char *format, char *options)
 {
 	POINTER(fz_new_document_writer_with_buffer, buf, format, options)
 }
 
+// The writer takes the output, and drops it when it is dropped itself.
+EXPORT
+fz_document_writer * wasm_new_document_writer_with_output(fz_output *out, char *format, char *options)
+{
+	POINTER(fz_new_document_writer_with_output, out, format, options)
+}
+
 EXPORT
 fz_device * wasm_begin_page(fz_document_writer *wri, fz_rect *mediabox)
 {
@@ -571,19 +1783,202 @@ unsigned char * wasm_print_stext_page_as_json(fz_stext_page *page, float scale)
 	return data;
 }
 
-// TODO: search
+EXPORT
+int wasm_search_stext_page(fz_stext_page *page, const char *needle, int *marks, fz_quad *hit_bbox, int hit_max)
+{
+	INTEGER(fz_search_stext_page, page, needle, marks, hit_bbox, hit_max)
+}
+
+// Write the chars of a line into out, 13 words each: c, origin[2], quad[8],
+// size and font. Returns the number of chars in the line; if that is more
+// than max, nothing is written and the caller should try again with room
+// for that many.
+EXPORT
+int wasm_stext_line_get_chars(fz_stext_line *line, uint32_t *out, int max)
+{
+	fz_stext_char *ch;
+	int n = 0;
+	for (ch = line->first_char; ch; ch = ch->next)
+		++n;
+	if (n > max)
+		return n;
+	for (ch = line->first_char; ch; ch = ch->next, out += 13)
+	{
+		out[0] = ch->c;
+		memcpy(out + 1, &ch->origin, sizeof(fz_point));
+		memcpy(out + 3, &ch->quad, sizeof(fz_quad));
+		memcpy(out + 11, &ch->size, sizeof(float));
+		out[12] = (uint32_t)(uintptr_t)ch->font;
+	}
+	return n;
+}
+
+// Binary layout of a structured text page, all in 32-bit words:
+//   header: block count, line count, char count, font count, font name bytes
+//   blocks: type[nb], bbox[nb][4], first line and line count[nb][2]
+//   lines: wmode[nl], bbox[nl][4], first char and char count[nl][2]
+//   chars: c[nc], origin[nc][2], quad[nc][8], size[nc], font index[nc]
+//   fonts: flags[nf], name offset and length[nf][2], then the UTF-8 names
+// Boxes, points and sizes are floats; everything else is unsigned.
+
+enum {
+	STEXT_FONT_BOLD = 1,
+	STEXT_FONT_ITALIC = 2,
+	STEXT_FONT_SERIF = 4,
+	STEXT_FONT_MONO = 8,
+};
+
+static int find_stext_font(fz_font **fonts, int n, fz_font *font)
+{
+	int i;
+	// Runs of characters in the same font are the common case.
+	for (i = n - 1; i >= 0; --i)
+		if (fonts[i] == font)
+			return i;
+	return -1;
+}
+
+static fz_buffer *new_buffer_from_stext_page(fz_context *ctx, fz_stext_page *page)
+{
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_stext_char *ch;
+	fz_font **fonts = NULL;
+	fz_buffer *buf = NULL;
+	int nb = 0, nl = 0, nc = 0, nf = 0, fmax = 0, names = 0;
+
+	fz_var(fonts);
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		uint32_t *block_type, *block_lines, *line_wmode, *line_chars, *char_c, *char_font, *font_flags, *font_name;
+		float *block_bbox, *line_bbox, *char_origin, *char_quad, *char_size;
+		char *name_data;
+		size_t size;
+		int b = 0, l = 0, c = 0, i;
+
+		for (block = page->first_block; block; block = block->next)
+		{
+			++nb;
+			if (block->type != FZ_STEXT_BLOCK_TEXT)
+				continue;
+			for (line = block->u.t.first_line; line; line = line->next)
+			{
+				++nl;
+				for (ch = line->first_char; ch; ch = ch->next)
+				{
+					++nc;
+					if (find_stext_font(fonts, nf, ch->font) < 0)
+					{
+						if (nf == fmax)
+						{
+							fmax = fmax ? fmax * 2 : 16;
+							fonts = fz_realloc_array(ctx, fonts, fmax, fz_font*);
+						}
+						fonts[nf++] = ch->font;
+						names += strlen(fz_font_name(ctx, ch->font));
+					}
+				}
+			}
+		}
+
+		size = 4 * (5 + (size_t)nb * 7 + (size_t)nl * 7 + (size_t)nc * 13 + (size_t)nf * 3) + ((names + 3) & ~3);
+		buf = fz_new_buffer(ctx, size);
+		memset(buf->data, 0, size);
+		buf->len = size;
+
+		block_type = (uint32_t *)buf->data + 5;
+		block_bbox = (float *)(block_type + nb);
+		block_lines = (uint32_t *)(block_bbox + nb * 4);
+		line_wmode = block_lines + nb * 2;
+		line_bbox = (float *)(line_wmode + nl);
+		line_chars = (uint32_t *)(line_bbox + nl * 4);
+		char_c = line_chars + nl * 2;
+		char_origin = (float *)(char_c + nc);
+		char_quad = char_origin + nc * 2;
+		char_size = char_quad + nc * 8;
+		char_font = (uint32_t *)(char_size + nc);
+		font_flags = char_font + nc;
+		font_name = font_flags + nf;
+		name_data = (char *)(font_name + nf * 2);
+
+		((uint32_t *)buf->data)[0] = nb;
+		((uint32_t *)buf->data)[1] = nl;
+		((uint32_t *)buf->data)[2] = nc;
+		((uint32_t *)buf->data)[3] = nf;
+		((uint32_t *)buf->data)[4] = names;
+
+		for (block = page->first_block; block; block = block->next, ++b)
+		{
+			block_type[b] = block->type;
+			memcpy(&block_bbox[b * 4], &block->bbox, sizeof(fz_rect));
+			block_lines[b * 2] = l;
+			if (block->type != FZ_STEXT_BLOCK_TEXT)
+				continue;
+			for (line = block->u.t.first_line; line; line = line->next, ++l)
+			{
+				line_wmode[l] = line->wmode;
+				memcpy(&line_bbox[l * 4], &line->bbox, sizeof(fz_rect));
+				line_chars[l * 2] = c;
+				for (ch = line->first_char; ch; ch = ch->next, ++c)
+				{
+					char_c[c] = ch->c;
+					memcpy(&char_origin[c * 2], &ch->origin, sizeof(fz_point));
+					memcpy(&char_quad[c * 8], &ch->quad, sizeof(fz_quad));
+					char_size[c] = ch->size;
+					char_font[c] = find_stext_font(fonts, nf, ch->font);
+				}
+				line_chars[l * 2 + 1] = c - line_chars[l * 2];
+			}
+			block_lines[b * 2 + 1] = l - block_lines[b * 2];
+		}
+
+		names = 0;
+		for (i = 0; i < nf; ++i)
+		{
+			const char *name = fz_font_name(ctx, fonts[i]);
+			size_t len = strlen(name);
+			font_flags[i] =
+				(fz_font_is_bold(ctx, fonts[i]) ? STEXT_FONT_BOLD : 0) |
+				(fz_font_is_italic(ctx, fonts[i]) ? STEXT_FONT_ITALIC : 0) |
+				(fz_font_is_serif(ctx, fonts[i]) ? STEXT_FONT_SERIF : 0) |
+				(fz_font_is_monospaced(ctx, fonts[i]) ? STEXT_FONT_MONO : 0);
+			font_name[i * 2] = names;
+			font_name[i * 2 + 1] = len;
+			memcpy(name_data + names, name, len);
+			names += len;
+		}
+	}
+	fz_always(ctx)
+		fz_free(ctx, fonts);
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+EXPORT
+fz_buffer * wasm_new_buffer_from_stext_page(fz_stext_page *page)
+{
+	POINTER(new_buffer_from_stext_page, page)
+}
 
 // --- Document ---
 
 EXPORT
 fz_document * wasm_open_document_with_buffer(char *magic, fz_buffer *buffer)
 {
+	register_document_handlers(ctx);
 	POINTER(fz_open_document_with_buffer, magic, buffer)
 }
 
 EXPORT
 fz_document * wasm_open_document_with_stream(char *magic, fz_stream *stream)
 {
+	register_document_handlers(ctx);
 	POINTER(fz_open_document_with_stream, magic, stream)
 }
 
@@ -649,7 +2044,12 @@ void wasm_layout_document(fz_document *doc, float w, float h, float em)
 
 // --- Page ---
 
-// TODO: Page.search
+EXPORT
+int wasm_search_page(fz_page *page, const char *needle, int *marks, fz_quad *hit_bbox, int hit_max)
+{
+	INTEGER(fz_search_page, page, needle, marks, hit_bbox, hit_max)
+}
+
 // TODO: Page.createLink
 // TODO: Page.deleteLink
 
@@ -666,47 +2066,74 @@ fz_link * wasm_load_links(fz_page *page)
 }
 
 EXPORT
-void wasm_run_page(fz_page *page, fz_device *dev, fz_matrix *ctm)
+void wasm_run_page(fz_page *page, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
 {
-	VOID(fz_run_page, page, dev, *ctm, NULL)
+	VOID(fz_run_page, page, dev, *ctm, cookie)
 }
 
 EXPORT
-void wasm_run_page_contents(fz_page *page, fz_device *dev, fz_matrix *ctm)
+void wasm_run_page_contents(fz_page *page, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
 {
-	VOID(fz_run_page_contents, page, dev, *ctm, NULL)
+	VOID(fz_run_page_contents, page, dev, *ctm, cookie)
 }
 
 EXPORT
-void wasm_run_page_annots(fz_page *page, fz_device *dev, fz_matrix *ctm)
+void wasm_run_page_annots(fz_page *page, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
 {
-	VOID(fz_run_page_annots, page, dev, *ctm, NULL)
+	VOID(fz_run_page_annots, page, dev, *ctm, cookie)
 }
 
 EXPORT
-void wasm_run_page_widgets(fz_page *page, fz_device *dev, fz_matrix *ctm)
+void wasm_run_page_widgets(fz_page *page, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
 {
-	VOID(fz_run_page_widgets, page, dev, *ctm, NULL)
+	VOID(fz_run_page_widgets, page, dev, *ctm, cookie)
 }
 
 EXPORT
-fz_stext_page * wasm_new_stext_page_from_page(fz_page *page)
+fz_stext_page * wasm_new_stext_page_from_page(fz_page *page, fz_cookie *cookie)
 {
 	// TODO: parse options
 	fz_stext_options options = { FZ_STEXT_PRESERVE_SPANS };
-	POINTER(fz_new_stext_page_from_page, page, &options)
+	POINTER(new_stext_page, page, NULL, &options, cookie)
+}
+
+static fz_display_list *new_display_list_from_page(fz_context *ctx, fz_page *page, int contents_only, fz_cookie *cookie)
+{
+	fz_display_list *list;
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+	fz_try(ctx)
+	{
+		dev = fz_new_list_device(ctx, list);
+		if (contents_only)
+			fz_run_page_contents(ctx, page, dev, fz_identity, cookie);
+		else
+			fz_run_page(ctx, page, dev, fz_identity, cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	return list;
 }
 
 EXPORT
-fz_display_list * wasm_new_display_list_from_page(fz_page *page)
+fz_display_list * wasm_new_display_list_from_page(fz_page *page, fz_cookie *cookie)
 {
-	POINTER(fz_new_display_list_from_page, page)
+	POINTER(new_display_list_from_page, page, 0, cookie)
 }
 
 EXPORT
-fz_display_list * wasm_new_display_list_from_page_contents(fz_page *page)
+fz_display_list * wasm_new_display_list_from_page_contents(fz_page *page, fz_cookie *cookie)
 {
-	POINTER(fz_new_display_list_from_page_contents, page)
+	POINTER(new_display_list_from_page, page, 1, cookie)
 }
 
 EXPORT
@@ -766,6 +2193,12 @@ int wasm_pdf_validate_change_history(pdf_document *doc)
 	INTEGER(pdf_validate_change_history, doc)
 }
 
+EXPORT
+int wasm_pdf_can_be_saved_incrementally(pdf_document *doc)
+{
+	INTEGER(pdf_can_be_saved_incrementally, doc)
+}
+
 EXPORT
 void wasm_pdf_enable_journal(pdf_document *doc)
 {
@@ -997,6 +2430,52 @@ fz_buffer * wasm_pdf_write_document_buffer(pdf_document *doc, char *options)
 	return buffer;
 }
 
+static void pdf_write_document_output(fz_context *ctx, pdf_document *doc, fz_output *out, char *options)
+{
+	pdf_write_options pwo;
+	pdf_parse_write_options(ctx, &pwo, options);
+	pdf_write_document(ctx, doc, out, &pwo);
+	fz_close_output(ctx, out);
+}
+
+EXPORT
+void wasm_pdf_write_document(pdf_document *doc, fz_output *out, char *options)
+{
+	VOID(pdf_write_document_output, doc, out, options)
+}
+
+static int fetch_stream_is_complete(fz_stream *stm);
+
+// Write only what an incremental save appends to the original file. MuPDF
+// first copies the original file to the output, reading all of it, so the
+// JS output passes on only what comes after it, with the offsets in the new
+// xref section still counted from the start of the file. A progressively
+// loaded document must therefore have been loaded completely, and be kept
+// in memory whole, since a block that has yet to arrive cannot be waited
+// for in the middle of the write.
+static void pdf_write_document_update(fz_context *ctx, pdf_document *doc, fz_output *out, char *options)
+{
+	struct js_output_state *state = out->state;
+	pdf_write_options pwo;
+	if (out->write != js_output_write)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "incremental update needs a JS output");
+	if (state->pos != 0)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "incremental update needs an unused output");
+	if (doc->file && !fetch_stream_is_complete(doc->file))
+		fz_throw(ctx, FZ_ERROR_GENERIC, "incremental update needs the whole document loaded");
+	pdf_parse_write_options(ctx, &pwo, options);
+	pwo.do_incremental = 1;
+	state->skip = doc->file_size;
+	pdf_write_document(ctx, doc, out, &pwo);
+	fz_close_output(ctx, out);
+}
+
+EXPORT
+void wasm_pdf_write_document_update(pdf_document *doc, fz_output *out, char *options)
+{
+	VOID(pdf_write_document_update, doc, out, options)
+}
+
 // --- PDFPage ---
 
 EXPORT
@@ -1063,15 +2542,45 @@ fz_rect * wasm_pdf_bound_annot(pdf_annot *annot)
 }
 
 EXPORT
-void wasm_pdf_run_annot(pdf_annot *annot, fz_device *dev, fz_matrix *ctm)
+void wasm_pdf_run_annot(pdf_annot *annot, fz_device *dev, fz_matrix *ctm, fz_cookie *cookie)
+{
+	VOID(pdf_run_annot, annot, dev, *ctm, cookie)
+}
+
+// As pdf_new_pixmap_from_annot, with a cookie.
+static fz_pixmap *new_pixmap_from_annot(fz_context *ctx, pdf_annot *annot, fz_matrix ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
 {
-	VOID(pdf_run_annot, annot, dev, *ctm, NULL)
+	fz_irect bbox = fz_round_rect(fz_transform_rect(pdf_bound_annot(ctx, annot), ctm));
+	fz_pixmap *pix;
+	fz_device *dev = NULL;
+
+	fz_var(dev);
+
+	pix = fz_new_pixmap_with_bbox(ctx, colorspace, bbox, NULL, alpha);
+	fz_try(ctx)
+	{
+		if (alpha)
+			fz_clear_pixmap(ctx, pix);
+		else
+			fz_clear_pixmap_with_value(ctx, pix, 0xFF);
+		dev = fz_new_draw_device(ctx, ctm, pix);
+		pdf_run_annot(ctx, annot, dev, fz_identity, cookie);
+		fz_close_device(ctx, dev);
+	}
+	fz_always(ctx)
+		fz_drop_device(ctx, dev);
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		fz_rethrow(ctx);
+	}
+	return pix;
 }
 
 EXPORT
-fz_pixmap * wasm_pdf_new_pixmap_from_annot(pdf_annot *annot, fz_matrix *ctm, fz_colorspace *colorspace, int alpha)
+fz_pixmap * wasm_pdf_new_pixmap_from_annot(pdf_annot *annot, fz_matrix *ctm, fz_colorspace *colorspace, int alpha, fz_cookie *cookie)
 {
-	POINTER(pdf_new_pixmap_from_annot, annot, *ctm, colorspace, NULL, alpha)
+	POINTER(new_pixmap_from_annot, annot, *ctm, colorspace, alpha, cookie)
 }
 
 EXPORT
@@ -1385,27 +2894,53 @@ char * wasm_pdf_sprint_obj(pdf_obj *obj, int tight, int ascii)
 
 /* PROGRESSIVE FETCH STREAM */
 
+// The bytes come from a source in JS: ranges fetched over HTTP, or any
+// reader, which may write straight into the block slots. Loaded blocks are
+// kept in a fixed number of slots. When the slots cover the whole file
+// nothing is ever evicted; otherwise the least recently read block makes
+// room, and is read again if it is needed later.
+
 struct fetch_state
 {
 	int block_shift;
 	int block_size;
-	int content_length; // Content-Length in bytes
+	int64_t content_length; // Content-Length in bytes
 	int map_length; // Content-Length in blocks
-	uint8_t *content; // Array buffer with bytes
-	uint8_t *map; // Map of which blocks have been requested and loaded.
+	uint8_t *map; // Map of which blocks have been requested, loaded or failed.
+	uint8_t *failures; // How many reads of each block have failed.
+	int *block_slot; // Slot of each loaded block, or -1.
+	int slot_count;
+	int *slot_block; // Block in each slot, or -1 if the slot is free.
+	unsigned int *slot_used; // When each slot was last read from.
+	unsigned int clock;
+	int current_slot; // Slot the stream buffer points into, or -1.
+	uint8_t *content; // Memory for all slots.
 };
 
-EM_JS(void, js_open_fetch, (struct fetch_state *state, char *url, int content_length, int block_shift, int prefetch), {
-	libmupdf.fetchOpen(state, UTF8ToString(url), content_length, block_shift, prefetch);
+EM_JS(void, js_open_fetch, (struct fetch_state *state, char *url, double content_length, int block_shift, int prefetch, int slot_count), {
+	libmupdf.fetchOpen(state, UTF8ToString(url), content_length, block_shift, prefetch, slot_count);
 });
 
-static void fetch_close(fz_context *ctx, void *state_)
+static void free_fetch_state(fz_context *ctx, struct fetch_state *state)
 {
-	struct fetch_state *state = state_;
 	fz_free(ctx, state->content);
 	fz_free(ctx, state->map);
+	fz_free(ctx, state->failures);
+	fz_free(ctx, state->block_slot);
+	fz_free(ctx, state->slot_block);
+	fz_free(ctx, state->slot_used);
 	state->content = NULL;
 	state->map = NULL;
+	state->failures = NULL;
+	state->block_slot = NULL;
+	state->slot_block = NULL;
+	state->slot_used = NULL;
+}
+
+static void fetch_close(fz_context *ctx, void *state_)
+{
+	struct fetch_state *state = state_;
+	free_fetch_state(ctx, state);
 	// TODO: wait for all outstanding requests to complete, then free state
 	// fz_free(ctx, state);
 	EM_ASM({
@@ -1417,6 +2952,7 @@ static void fetch_seek(fz_context *ctx, fz_stream *stm, int64_t offset, int when
 {
 	struct fetch_state *state = stm->state;
 	stm->wp = stm->rp = state->content;
+	state->current_slot = -1;
 	if (whence == SEEK_END)
 		stm->pos = state->content_length + offset;
 	else if (whence == SEEK_CUR)
@@ -1432,27 +2968,40 @@ static void fetch_seek(fz_context *ctx, fz_stream *stm, int64_t offset, int when
 static int fetch_next(fz_context *ctx, fz_stream *stm, size_t len)
 {
 	struct fetch_state *state = stm->state;
+	int block, slot;
+	int64_t start, end;
+	uint8_t *data;
 
-	int block = stm->pos >> state->block_shift;
-	int start = block << state->block_shift;
-	int end = start + state->block_size;
+	if (stm->pos >= state->content_length)
+		return -1;
+
+	block = (int)(stm->pos >> state->block_shift);
+	start = (int64_t)block << state->block_shift;
+	end = start + state->block_size;
 	if (end > state->content_length)
 		end = state->content_length;
 
+	// A synchronous source has loaded the block by the time fetchRead returns.
 	if (state->map[block] == 0) {
 		state->map[block] = 1;
 		EM_ASM({
 			libmupdf.fetchRead($0, $1);
 		}, state, block);
-		fz_throw(ctx, FZ_ERROR_TRYLATER, "waiting for data");
 	}
 
-	if (state->map[block] == 1) {
+	if (state->map[block] == 3)
+		fz_throw(ctx, FZ_ERROR_GENERIC, "cannot read block %d", block);
+
+	if (state->map[block] == 1)
 		fz_throw(ctx, FZ_ERROR_TRYLATER, "waiting for data");
-	}
 
-	stm->rp = state->content + stm->pos;
-	stm->wp = state->content + end;
+	slot = state->block_slot[block];
+	state->slot_used[slot] = ++state->clock;
+	state->current_slot = slot;
+	data = state->content + ((size_t)slot << state->block_shift);
+
+	stm->rp = data + (stm->pos - start);
+	stm->wp = data + (end - start);
 	stm->pos = end;
 
 	if (stm->rp < stm->wp)
@@ -1460,17 +3009,113 @@ static int fetch_next(fz_context *ctx, fz_stream *stm, size_t len)
 	return -1;
 }
 
+// Whether a stream can be read through without waiting: true for anything
+// but a progressive fetch stream, and for that only when every block is in
+// memory.
+static int fetch_stream_is_complete(fz_stream *stm)
+{
+	struct fetch_state *state;
+	int i;
+	if (stm->next != fetch_next)
+		return 1;
+	state = stm->state;
+	if (!state->map)
+		return 0;
+	for (i = 0; i < state->map_length; ++i)
+		if (state->map[i] != 2 || state->block_slot[i] < 0)
+			return 0;
+	return 1;
+}
+
+// Find a slot for a new block: a free one, or else the least recently read
+// one that the stream is not reading from right now.
+static int fetch_take_slot(struct fetch_state *state)
+{
+	int i, best = -1;
+	for (i = 0; i < state->slot_count; ++i)
+	{
+		if (state->slot_block[i] < 0)
+			return i;
+		if (i != state->current_slot && (best < 0 || state->slot_used[i] < state->slot_used[best]))
+			best = i;
+	}
+	if (best >= 0)
+	{
+		int old = state->slot_block[best];
+		state->map[old] = 0;
+		state->block_slot[old] = -1;
+		state->slot_block[best] = -1;
+		EM_ASM({
+			libmupdf.fetchEvict($0, $1);
+		}, state, old);
+	}
+	return best;
+}
+
+// A source stores a block by writing it to the memory returned here, then
+// calling wasm_stream_block_loaded. Returns NULL if the block is loaded.
+EXPORT
+uint8_t *wasm_stream_block_slot(struct fetch_state *state, int block)
+{
+	int slot;
+	if (!state->content || state->map[block] == 2)
+		return NULL;
+	slot = state->block_slot[block];
+	if (slot < 0)
+	{
+		slot = fetch_take_slot(state);
+		if (slot < 0)
+			return NULL;
+		state->slot_block[slot] = block;
+		state->block_slot[block] = slot;
+	}
+	state->slot_used[slot] = ++state->clock;
+	return state->content + ((size_t)slot << state->block_shift);
+}
+
+// A block that failed to load is read again when next needed, until it has
+// failed this many times.
+#define FETCH_MAX_FAILURES 3
+
+// Mark a block as loaded, or as failed if ok is zero.
 EXPORT
-void wasm_on_data_fetched(struct fetch_state *state, int block, uint8_t *data, int size)
+void wasm_stream_block_loaded(struct fetch_state *state, int block, int ok)
 {
-	if (state->content) {
-		memcpy(state->content + (block << state->block_shift), data, size);
+	int slot;
+	if (!state->content || state->map[block] == 2)
+		return;
+	if (ok && state->block_slot[block] >= 0)
+	{
 		state->map[block] = 2;
+		return;
+	}
+	slot = state->block_slot[block];
+	if (slot >= 0)
+	{
+		state->slot_block[slot] = -1;
+		state->block_slot[block] = -1;
 	}
+	if (++state->failures[block] < FETCH_MAX_FAILURES)
+		state->map[block] = 0;
+	else
+		state->map[block] = 3;
+}
+
+// 0 = missing, 1 = requested, 2 = loaded, 3 = failed for good.
+EXPORT
+int wasm_stream_block_state(struct fetch_state *state, int block)
+{
+	if (!state->content)
+		return 3;
+	return state->map[block];
 }
 
+// With a cache_size of 0, or one larger than the file, the whole file is
+// kept in memory once fetched. A progressive stream lets MuPDF open a
+// linearized PDF and show its first pages before the rest has arrived,
+// throwing TRYLATER for what is still missing.
 EXPORT
-fz_stream *wasm_open_stream_from_url(char *url, int content_length, int block_size, int prefetch)
+fz_stream *wasm_open_stream_from_url(char *url, double content_length, int block_size, int prefetch, int cache_size, int progressive)
 {
 	fz_stream *stream = NULL;
 	struct fetch_state *state = NULL;
@@ -1481,31 +3126,47 @@ fz_stream *wasm_open_stream_from_url(char *url, int content_length, int block_si
 	fz_try (ctx)
 	{
 		int block_shift = (int)log2(block_size);
+		int64_t blocks;
+		int i;
 
 		if (block_shift < 10 || block_shift > 24)
 			fz_throw(ctx, FZ_ERROR_GENERIC, "invalid block shift: %d", block_shift);
+		blocks = ((int64_t)content_length + (1 << block_shift) - 1) >> block_shift;
+		if (content_length < 0 || blocks > INT_MAX)
+			fz_throw(ctx, FZ_ERROR_GENERIC, "invalid content length: %g", content_length);
 
-		state = fz_malloc(ctx, sizeof *state);
+		state = fz_malloc_struct(ctx, struct fetch_state);
 		state->block_shift = block_shift;
 		state->block_size = 1 << block_shift;
-		state->content_length = content_length;
-		state->content = fz_malloc(ctx, state->content_length);
-		state->map_length = content_length / state->block_size + 1;
-		state->map = fz_malloc(ctx, state->map_length);
-		memset(state->map, 0, state->map_length);
+		state->content_length = (int64_t)content_length;
+		// The same block count as fetchOpen.
+		state->map_length = fz_maxi(1, (int)blocks);
+		state->slot_count = state->map_length;
+		if (cache_size > 0 && (cache_size >> block_shift) < state->slot_count)
+			state->slot_count = fz_maxi(cache_size >> block_shift, 4);
+		state->current_slot = -1;
+		state->map = fz_calloc(ctx, state->map_length, 1);
+		state->failures = fz_calloc(ctx, state->map_length, 1);
+		state->block_slot = fz_malloc_array(ctx, state->map_length, int);
+		state->slot_block = fz_malloc_array(ctx, state->slot_count, int);
+		state->slot_used = fz_calloc(ctx, state->slot_count, sizeof(unsigned int));
+		for (i = 0; i < state->map_length; ++i)
+			state->block_slot[i] = -1;
+		for (i = 0; i < state->slot_count; ++i)
+			state->slot_block[i] = -1;
+		state->content = fz_malloc(ctx, (size_t)state->slot_count << block_shift);
 
 		stream = fz_new_stream(ctx, state, fetch_next, fetch_close);
-		// stream->progressive = 1;
+		stream->progressive = progressive;
 		stream->seek = fetch_seek;
 
-		js_open_fetch(state, url, content_length, block_shift, prefetch);
+		js_open_fetch(state, url, content_length, block_shift, prefetch, state->slot_count);
 	}
 	fz_catch(ctx)
 	{
 		if (state)
 		{
-			fz_free(ctx, state->content);
-			fz_free(ctx, state->map);
+			free_fetch_state(ctx, state);
 			fz_free(ctx, state);
 		}
 		fz_drop_stream(ctx, stream);
@@ -1513,18 +3174,3 @@ fz_stream *wasm_open_stream_from_url(char *url, int content_length, int block_si
 	}
 	return stream;
 }
-
-#if 0
-
-EXPORT
-int wasm_search_page(fz_page *page, const char *needle, int *marks, fz_quad *hit_bbox, int hit_max)
-{
-	int hitCount;
-	fz_try(ctx)
-		hitCount = fz_search_page(ctx, page, needle, marks, hit_bbox, hit_max);
-	fz_catch(ctx)
-		wasm_rethrow(ctx);
-	return hitCount;
-}
-
-#endif
@@ -194,6 +194,9 @@ class MupdfPageViewer {
 			// to be processed when the render ends.
 			// This also erases any previous queued render arguments.
 			this.queuedRenderArgs = renderArgs
+			// A render at another zoom level is stale, so stop it.
+			if (this.renderPromise != null && this.renderDpi !== renderArgs.dpi)
+				this.worker.cancel?.(this.renderPromise)
 			return
 		}
 		if (this.canvasNode?.renderArgs != null) {
@@ -211,22 +214,28 @@ class MupdfPageViewer {
 
 			if (this.sizeIsDefault) {
 				// TODO - remove "+ 1"
-				this.size = await this.worker.getPageSize(this.pageNumber + 1)
-				this.sizeIsDefault = false
-				this._updateSize(dpi)
+				let size = await this.worker.getPageSize(this.pageNumber + 1)
+				// Keep the default size if the request was cancelled, and ask again next time.
+				if (size != null) {
+					this.size = size
+					this.sizeIsDefault = false
+					this._updateSize(dpi)
+				}
 			}
 			// TODO - remove "+ 1"
+			this.renderDpi = dpi
 			this.renderPromise = this.worker.drawPageAsPixmap(this.pageNumber + 1, dpi * devicePixelRatio)
-			let imageData = await this.renderPromise
-
-			// if render was aborted, return early
-			if (imageData == null)
-				return
-
-			this.canvasNode.renderArgs = renderArgs
-			this.canvasNode.width = imageData.width
-			this.canvasNode.height = imageData.height
-			this.canvasCtx.putImageData(imageData, 0, 0)
+			let pixels = await this.renderPromise
+
+			// A cancelled render gives null; the queued render below replaces it.
+			if (pixels != null) {
+				// The pixel buffer was transferred from the worker, so this wraps it without a copy.
+				let imageData = new ImageData(pixels.data, pixels.width, pixels.height)
+				this.canvasNode.renderArgs = renderArgs
+				this.canvasNode.width = imageData.width
+				this.canvasNode.height = imageData.height
+				this.canvasCtx.putImageData(imageData, 0, 0)
+			}
 		} catch (error) {
 			this.showError("_loadPageImg", error)
 		} finally {
@@ -236,8 +245,9 @@ class MupdfPageViewer {
 
 		if (this.queuedRenderArgs != null) {
 			// TODO - Error handling
-			this._loadPageImg(this.queuedRenderArgs)
+			let queuedRenderArgs = this.queuedRenderArgs
 			this.queuedRenderArgs = null
+			this._loadPageImg(queuedRenderArgs)
 		}
 	}
 
@@ -271,6 +281,12 @@ class MupdfPageViewer {
 			this.textPromise = this.worker.getPageText(this.pageNumber + 1)
 
 			this.textResultObject = await this.textPromise
+			if (this.textResultObject == null) {
+				// The request was cancelled; try again next time.
+				this.textNode.remove()
+				this.textNode = null
+				return
+			}
 			this._applyPageText(this.textResultObject, dpi)
 		} catch (error) {
 			this.showError("_loadPageText", error)
@@ -286,24 +302,37 @@ class MupdfPageViewer {
 		let html_w = []
 		let text_len = []
 		let scale = dpi / 72
+		// See StructuredText.fromBinary in mupdf.js for the layout.
+		let { blockType, blockLines, lineBBox, lineChars, charCode, charOrigin, charSize, charFont, fontFlags } = textResultObject
+		let { BLOCK_TEXT, FONT_BOLD, FONT_ITALIC, FONT_SERIF, FONT_MONO } = mupdfView.StructuredText
 		this.textNode.replaceChildren()
-		for (let block of textResultObject.blocks) {
-			if (block.type === "text") {
-				for (let line of block.lines) {
-					let text = document.createElement("span")
-					text.style.left = line.bbox.x * scale + "px"
-					text.style.top = (line.y - line.font.size * 0.8) * scale + "px"
-					text.style.height = line.bbox.h * scale + "px"
-					text.style.fontSize = line.font.size * scale + "px"
-					text.style.fontFamily = line.font.family
-					text.style.fontWeight = line.font.weight
-					text.style.fontStyle = line.font.style
-					text.textContent = line.text
-					this.textNode.appendChild(text)
-					nodes.push(text)
-					pdf_w.push(line.bbox.w * scale)
-					text_len.push(line.text.length - 1)
-				}
+		for (let b = 0; b < blockType.length; ++b) {
+			if (blockType[b] !== BLOCK_TEXT)
+				continue
+			let l1 = blockLines[b * 2] + blockLines[b * 2 + 1]
+			for (let l = blockLines[b * 2]; l < l1; ++l) {
+				let c0 = lineChars[l * 2]
+				let c1 = c0 + lineChars[l * 2 + 1]
+				if (c0 === c1)
+					continue
+				let line = ""
+				for (let c = c0; c < c1; ++c)
+					line += String.fromCodePoint(charCode[c])
+				let size = charSize[c0]
+				let flags = fontFlags[charFont[c0]]
+				let text = document.createElement("span")
+				text.style.left = lineBBox[l * 4] * scale + "px"
+				text.style.top = (charOrigin[c0 * 2 + 1] - size * 0.8) * scale + "px"
+				text.style.height = (lineBBox[l * 4 + 3] - lineBBox[l * 4 + 1]) * scale + "px"
+				text.style.fontSize = size * scale + "px"
+				text.style.fontFamily = (flags & FONT_SERIF) ? "serif" : (flags & FONT_MONO) ? "monospace" : "sans-serif"
+				text.style.fontWeight = (flags & FONT_BOLD) ? "bold" : "normal"
+				text.style.fontStyle = (flags & FONT_ITALIC) ? "italic" : "normal"
+				text.textContent = line
+				this.textNode.appendChild(text)
+				nodes.push(text)
+				pdf_w.push((lineBBox[l * 4 + 2] - lineBBox[l * 4]) * scale)
+				text_len.push(line.length - 1)
 			}
 		}
 		for (let i = 0; i < nodes.length; ++i) {
@@ -340,6 +369,12 @@ class MupdfPageViewer {
 			this.linksPromise = this.worker.getPageLinks(this.pageNumber + 1)
 
 			this.linksResultObject = await this.linksPromise
+			if (this.linksResultObject == null) {
+				// The request was cancelled; try again next time.
+				this.linksNode.remove()
+				this.linksNode = null
+				return
+			}
 			this._applyPageLinks(this.linksResultObject, dpi)
 		} catch (error) {
 			this.showError("_loadPageLinks", error)
@@ -394,6 +429,12 @@ class MupdfPageViewer {
 				console.log("SEARCH", this.pageNumber + 1, JSON.stringify(this.searchNeedle))
 				this.searchPromise = this.worker.search(this.pageNumber + 1, this.searchNeedle)
 				this.searchResultObject = await this.searchPromise
+				if (this.searchResultObject == null) {
+					// The request was cancelled; try again next time.
+					this.searchHitsNode.remove()
+					this.searchHitsNode = null
+					return
+				}
 			} else {
 				this.searchResultObject = []
 			}
@@ -464,8 +505,10 @@ class MupdfDocumentHandler {
 						handler.activePages.add(entry.target)
 					} else {
 						handler.activePages.delete(entry.target)
+						mupdfWorker.cancelPage?.(entry.target.pageNumber + 1)
 					}
 				}
+				handler._scheduleUpdate()
 			},
 			{
 				// This means we have roughly five viewports of vertical "head start" where
@@ -474,17 +517,12 @@ class MupdfDocumentHandler {
 			}
 		)
 
-		// TODO
-		// This is a hack to compensate for the lack of a priority queue
-		// We wait until the user has stopped scrolling to load pages.
-		let scrollTimer = null
+		// Requests are prioritized by distance from the viewport, so we can
+		// update on every frame while scrolling; pages that were already
+		// requested at the right zoom level are skipped.
+		handler.updateFrame = null
 		handler.scrollListener = function (event) {
-			if (scrollTimer !== null)
-				clearTimeout(scrollTimer)
-			scrollTimer = setTimeout(() => {
-				scrollTimer = null
-				handler._updateView()
-			}, 50)
+			handler._scheduleUpdate()
 		}
 		document.addEventListener("scroll", handler.scrollListener)
 
@@ -546,6 +584,7 @@ class MupdfDocumentHandler {
 		handler.searchStatusDiv = searchStatusDiv
 		handler.searchDivInput = searchDivInput
 		handler.currentSearchPage = 1
+		handler.searchGeneration = 0
 
 		// TODO use rootDiv instead
 		pagesDiv.addEventListener(
@@ -576,16 +615,37 @@ class MupdfDocumentHandler {
 			handler.hideOutline()
 		}
 
-		// TODO - remove once we add a priority queue
-		for (let i = 0; i < Math.min(pageCount, 5); ++i) {
-			handler.activePages.add(pages[i].rootNode)
-		}
-
 		handler._updateView()
 		return handler
 	}
 
+	_scheduleUpdate() {
+		if (this.updateFrame != null)
+			return
+		this.updateFrame = requestAnimationFrame(() => {
+			this.updateFrame = null
+			this._updateView()
+		})
+	}
+
+	// Tell the workers how far each active page is from the viewport.
+	_updatePriorities() {
+		let viewHeight = window.innerHeight
+		let priorities = []
+		for (const node of this.activePages) {
+			let rect = node.getBoundingClientRect()
+			let distance = 0
+			if (rect.bottom < 0)
+				distance = -rect.bottom
+			else if (rect.top > viewHeight)
+				distance = rect.top - viewHeight
+			priorities.push([ node.pageNumber + 1, distance ])
+		}
+		this.mupdfWorker.setPagePriorities?.(priorities)
+	}
+
 	_updateView() {
+		this._updatePriorities()
 		const dpi = this._dpi()
 		for (const page of this.activePages) {
 			this.pages[page.pageNumber].render(dpi, this.searchNeedle)
@@ -657,39 +717,41 @@ class MupdfDocumentHandler {
 
 	async runSearch(direction) {
 		let searchStatusDiv = this.searchStatusDiv
+		let needle = this.searchNeedle
+		let generation = ++this.searchGeneration
 
 		try {
-			let page = this.currentSearchPage + direction
-			while (page >= 1 && page < this.pageCount) {
-				// We run the check once per loop iteration,
-				// in case the search was cancel during the 'await' below.
-				if (this.searchNeedle === "") {
-					searchStatusDiv.textContent = ""
-					return
-				}
-
-				searchStatusDiv.textContent = `Searching page ${page}.`
+			let start = this.currentSearchPage + direction
+			if (needle === "" || start < 0 || start >= this.pageCount) {
+				searchStatusDiv.textContent = needle === "" ? "" : "No more search hits."
+				return
+			}
 
-				await this.pages[page]._loadPageSearch(this._dpi(), this.searchNeedle)
-				const hits = this.pages[page].searchResultObject ?? []
-				if (hits.length > 0) {
+			for await (let { results, next } of this.mupdfWorker.searchDocument(needle, start + 1, direction)) {
+				// The search was cancelled or changed while we waited.
+				if (generation !== this.searchGeneration || needle !== this.searchNeedle)
+					return
+				if (results.length > 0) {
+					let { pageNumber, count } = results[0]
+					let page = pageNumber - 1
 					this.pages[page].rootNode.scrollIntoView()
 					this.currentSearchPage = page
-					searchStatusDiv.textContent = `${hits.length} hits on page ${page}.`
+					searchStatusDiv.textContent = `${count} ${count === 1 ? "hit" : "hits"} on page ${pageNumber}.`
 					return
 				}
-
-				page += direction
+				if (next != null)
+					searchStatusDiv.textContent = `Searching page ${next}.`
 			}
 
-			searchStatusDiv.textContent = "No more search hits."
+			if (generation === this.searchGeneration)
+				searchStatusDiv.textContent = "No more search hits."
 		} catch (error) {
 			console.error(`mupdf.runSearch: ${error.message}:\n${error.stack}`)
 		}
 	}
 
 	cancelSearch() {
-		// TODO
+		++this.searchGeneration
 	}
 
 	showOutline() {
@@ -737,6 +799,8 @@ class MupdfDocumentHandler {
 		for (let page of this.pages ?? []) {
 			page.clear()
 		}
+		if (this.updateFrame != null)
+			cancelAnimationFrame(this.updateFrame)
 		this.pageObserver?.disconnect()
 		this.cancelSearch()
 	}
@@ -794,6 +858,7 @@ class MupdfDocumentViewer {
 			let acceptRanges = headResponse.headers.get("Accept-Ranges")
 			let contentLength = headResponse.headers.get("Content-Length")
 			let contentType = headResponse.headers.get("Content-Type")
+			let validator = headResponse.headers.get("ETag") || headResponse.headers.get("Last-Modified")
 			// TODO - Log less stuff
 			console.log("HEAD", url)
 			console.log("Content-Length", contentLength)
@@ -801,7 +866,7 @@ class MupdfDocumentViewer {
 
 			if (acceptRanges === "bytes" && progressive) {
 				console.log("USING HTTP RANGE REQUESTS")
-				await mupdfView.openDocumentFromUrl(url, contentLength, progressive, prefetch, contentType || url)
+				await mupdfView.openDocumentFromUrl(url, Number(contentLength), progressive, prefetch, contentType || url, validator)
 			} else {
 				let bodyResponse = await fetch(url)
 				if (!bodyResponse.ok)
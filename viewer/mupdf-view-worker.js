@@ -20,38 +20,96 @@
 // Artifex Software, Inc., 1305 Grant Avenue - Suite 200, Novato,
 // CA 94945, U.S.A., +1(415)492-9861, for further information.
 
-/* global mupdf */
+/* global mupdf, libmupdf */
 
 "use strict"
 
-// Import the WASM module
-globalThis.__filename = "../dist/mupdf-wasm.js"
-importScripts("../dist/mupdf-wasm.js")
-importScripts("../src/mupdf.js")
+// The first message has the WASM module, which the main thread compiles once
+// for all workers (see mupdf-view.js), and then we import the library.
+// With cross-origin isolation we can use the threaded build, whose shared
+// memory lets the main thread abort renders that are already running. Each
+// worker renders on one thread, since there are several workers, so the
+// threaded build starts no threads of its own.
+onmessage = function (event) {
+	let [ type, wasmModule ] = event.data
+	if (type !== "INIT")
+		return postMessage([ "ERROR", `Unexpected first message: ${type}` ])
+
+	globalThis.mupdfOptions = { wasmModule, lazyHandlers: true, threads: 1 }
+	if (globalThis.crossOriginIsolated) {
+		globalThis.__filename = "../dist/mupdf-wasm-mt.js"
+		importScripts("../dist/mupdf-wasm-mt.js")
+	} else {
+		globalThis.__filename = "../dist/mupdf-wasm.js"
+		importScripts("../dist/mupdf-wasm.js")
+	}
+	importScripts("../src/mupdf.js")
+
+	mupdf.onFetchCompleted = onFetchCompleted
+	onmessage = handleMessage
+
+	mupdf.ready
+		.then((result) => postMessage([ "READY", result, Object.keys(workerMethods), textConstants() ]))
+		.catch((error) => postMessage([ "ERROR", error ]))
+}
+
+// The block type and font flag constants of StructuredText, for the text
+// layer on the main thread, which does not load mupdf.js.
+function textConstants() {
+	let { BLOCK_TEXT, BLOCK_IMAGE, FONT_BOLD, FONT_ITALIC, FONT_SERIF, FONT_MONO } = mupdf.StructuredText
+	return { BLOCK_TEXT, BLOCK_IMAGE, FONT_BOLD, FONT_ITALIC, FONT_SERIF, FONT_MONO }
+}
 
-mupdf.ready
-	.then((result) => postMessage([ "READY", result, Object.keys(workerMethods) ]))
-	.catch((error) => postMessage([ "ERROR", error ]))
+// Message id of the request being handled.
+let currentId = null
 
-onmessage = async function (event) {
+async function handleMessage(event) {
 	let [ func, id, args ] = event.data
+	if (func === "FETCHED")
+		return relayDone(id, ...args)
+	if (func === "STORE")
+		return openStream?.storeRange(...args)
 	await mupdf.ready
 
 	try {
-		let result = workerMethods[func](...args)
-		postMessage([ "RESULT", id, result ])
+		currentId = id
+		let result = await workerMethods[func](...args)
+		postMessage([ "RESULT", id, result ], transferList(result))
 	} catch (error) {
 		if (error instanceof mupdf.TryLaterError) {
 			trylaterQueue.push(event)
 		} else {
 			postMessage([ "ERROR", id, { name: error.name, message: error.message, stack: error.stack } ])
 		}
+	} finally {
+		currentId = null
 	}
 }
 
+// Move pixel and file data to the main thread instead of copying it.
+// Views into the wasm heap itself must never be transferred.
+function transferList(result) {
+	let buffer = result?.buffer
+	if (ArrayBuffer.isView(result?.data))
+		buffer = result.data.buffer
+	if (buffer instanceof ArrayBuffer && buffer !== libmupdf.HEAPU8.buffer)
+		return [ buffer ]
+	return []
+}
+
+// Create a cookie for the current request and tell the main thread how to
+// abort it, if it can (this needs shared memory).
+function newCookie() {
+	let cookie = new mupdf.Cookie()
+	let handle = cookie.getAbortHandle()
+	if (handle)
+		postMessage([ "COOKIE", currentId, handle ])
+	return cookie
+}
+
 let trylaterScheduled = false
 let trylaterQueue = []
-mupdf.onFetchCompleted = function (_id) {
+function onFetchCompleted(_id) {
 	if (!trylaterScheduled) {
 		trylaterScheduled = true
 
@@ -59,7 +117,7 @@ mupdf.onFetchCompleted = function (_id) {
 			trylaterScheduled = false
 			let currentQueue = trylaterQueue
 			trylaterQueue = []
-			currentQueue.forEach(onmessage)
+			currentQueue.forEach(handleMessage)
 		}, 0)
 	}
 }
@@ -69,15 +127,165 @@ const workerMethods = {}
 let openStream = null
 let openDocument = null
 
+// Loaded pages and display lists of their contents, least recently used
+// first. The lists only hold the page contents; annotations and widgets are
+// run on top of them when rendering, so editing an annotation does not make
+// a cached list stale. Zooming, text extraction and search replay the list
+// instead of interpreting the page again.
+const pageCache = new Map()
+let pageCacheSize = 16
+
+function loadPage(pageNumber) {
+	let entry = pageCache.get(pageNumber)
+	if (entry) {
+		pageCache.delete(pageNumber)
+	} else {
+		entry = { page: openDocument.loadPage(pageNumber - 1), list: null, text: null }
+	}
+	pageCache.set(pageNumber, entry)
+	trimPageCache()
+	return entry
+}
+
+// Returns null if the cookie was aborted while the list was recorded.
+function loadDisplayList(entry, cookie = null) {
+	if (!entry.list) {
+		let ownCookie = cookie ?? new mupdf.Cookie()
+		let list = entry.page.toDisplayList(false, ownCookie)
+		let aborted = ownCookie.isAborted()
+		// A list missing parts of the page (such as data that has not been
+		// fetched yet) is used once but not kept.
+		let incomplete = ownCookie.isIncomplete()
+		if (ownCookie !== cookie)
+			ownCookie.destroy()
+		if (aborted) {
+			list.destroy()
+			return null
+		}
+		if (incomplete)
+			return list
+		entry.list = list
+	}
+	return entry.list
+}
+
+// Structured text is kept along with the list once a page has been
+// searched or had its text extracted.
+function loadStructuredText(entry) {
+	if (!entry.text) {
+		let list = loadDisplayList(entry)
+		let text = list.toStructuredText()
+		if (list !== entry.list) {
+			list.destroy()
+			return text
+		}
+		entry.text = text
+	}
+	return entry.text
+}
+
+function dropPageCacheEntry(entry) {
+	entry.text?.destroy()
+	entry.list?.destroy()
+	entry.page.destroy()
+}
+
+function trimPageCache() {
+	while (pageCache.size > pageCacheSize) {
+		let [ pageNumber, entry ] = pageCache.entries().next().value
+		pageCache.delete(pageNumber)
+		dropPageCacheEntry(entry)
+	}
+}
+
+function clearPageCache() {
+	for (let entry of pageCache.values())
+		dropPageCacheEntry(entry)
+	pageCache.clear()
+}
+
+workerMethods.setPageCacheSize = function (size) {
+	pageCacheSize = Math.max(1, size)
+	trimPageCache()
+}
+
+// Drop cached pages and the resource store, to give memory back under
+// pressure. The heap does not shrink, but the memory is reused.
+workerMethods.trimMemory = function () {
+	clearPageCache()
+	mupdf.emptyStore()
+}
+
+workerMethods.getMemoryStats = function () {
+	return mupdf.getMemoryStats()
+}
+
+// Drop the cached display list of a page whose contents have changed.
+workerMethods.invalidatePage = function (pageNumber) {
+	let entry = pageCache.get(pageNumber)
+	if (entry) {
+		pageCache.delete(pageNumber)
+		dropPageCacheEntry(entry)
+	}
+}
+
 workerMethods.setLogFilters = function (filters) {
 	logFilters = filters
 }
 
-workerMethods.openStreamFromUrl = function (url, contentLength, progressive, prefetch) {
-	openStream = new mupdf.Stream(url, contentLength, Math.max(progressive << 10, 1 << 16), prefetch)
+// Files larger than this are not kept in memory whole.
+const streamCacheSize = 128 << 20
+
+// Fetched blocks are kept here across sessions, for documents served with
+// an ETag or Last-Modified header. Every worker reads the store, but only
+// the one told to write to it does; the main thread sends it what the other
+// workers fetch (STORE messages).
+let blockStore = null
+
+// The main thread fetches for all workers (see relayRead in mupdf-view.js).
+const relayReads = new Map()
+let lastRelayId = 0
+
+class RelaySource {
+	read(offset, length) {
+		let id = ++lastRelayId
+		postMessage([ "FETCH", id, [ offset, length ] ])
+		return new Promise((resolve, reject) => relayReads.set(id, { resolve, reject }))
+	}
+}
+
+function relayDone(id, data, error) {
+	let read = relayReads.get(id)
+	relayReads.delete(id)
+	if (data)
+		read?.resolve(data)
+	else
+		read?.reject(new Error(error))
+}
+
+workerMethods.openStreamFromUrl = async function (url, contentLength, blockSize, prefetch, validator, storeWriter = false) {
+	if (blockStore == null && typeof indexedDB !== "undefined")
+		blockStore = new mupdf.IndexedDBBlockStore("mupdf-blocks", { readOnly: !storeWriter })
+	openStream = await mupdf.Stream.fromUrl(url, {
+		contentLength,
+		validator,
+		blockSize,
+		prefetch,
+		cacheSize: streamCacheSize,
+		store: blockStore,
+		source: new RelaySource(),
+	})
+}
+
+// How much of a progressively loaded document has arrived.
+workerMethods.getStreamProgress = function () {
+	if (openStream == null)
+		return null
+	return { received: openStream.getBytesReceived(), length: openStream.getLength() }
 }
 
 workerMethods.openDocumentFromBuffer = function (buffer, magic) {
+	clearPageCache()
 	openDocument = mupdf.Document.openDocument(buffer, magic)
 }
 
@@ -85,10 +293,12 @@ workerMethods.openDocumentFromStream = function (magic) {
 	if (openStream == null) {
 		throw new Error("openDocumentFromStream called but no stream has been open")
 	}
+	clearPageCache()
 	openDocument = mupdf.Document.openDocument(openStream, magic)
 }
 
 workerMethods.freeDocument = function () {
+	clearPageCache()
 	openDocument?.destroy()
 	openDocument = null
 }
@@ -107,15 +317,14 @@ workerMethods.countPages = function () {
 
 // TODO - use hungarian notation for coord spaces
 // TODO - document the "- 1" better
-// TODO - keep page loaded?
 workerMethods.getPageSize = function (pageNumber) {
-	let page = openDocument.loadPage(pageNumber - 1)
+	let page = loadPage(pageNumber).page
 	let bounds = page.getBounds()
 	return { width: bounds[2] - bounds[0], height: bounds[3] - bounds[1] }
 }
 
 workerMethods.getPageLinks = function (pageNumber) {
-	let page = openDocument.loadPage(pageNumber - 1)
+	let page = loadPage(pageNumber).page
 	let links = page.getLinks()
 
 	return links.map((link) => {
@@ -142,14 +351,23 @@ workerMethods.getPageLinks = function (pageNumber) {
 }
 
 workerMethods.getPageText = function (pageNumber) {
-	let page = openDocument.loadPage(pageNumber - 1)
-	let text = page.toStructuredText(1).asJSON()
-	return JSON.parse(text)
+	let entry = loadPage(pageNumber)
+	let stext = loadStructuredText(entry)
+	let text = stext.asBinary()
+	if (stext !== entry.text)
+		stext.destroy()
+	return text
 }
 
-workerMethods.search = function (pageNumber, needle) {
-	let page = openDocument.loadPage(pageNumber - 1)
-	const hits = page.search(needle)
+function searchPage(entry, needle) {
+	let stext = loadStructuredText(entry)
+	let hits = stext.search(needle)
+	if (stext !== entry.text)
+		stext.destroy()
+	return hits
+}
+
+function hitsToBoxes(hits) {
 	let result = []
 	for (let hit of hits) {
 		for (let quad of hit) {
@@ -165,8 +383,43 @@ workerMethods.search = function (pageNumber, needle) {
 	return result
 }
 
+workerMethods.search = function (pageNumber, needle) {
+	return hitsToBoxes(searchPage(loadPage(pageNumber), needle))
+}
+
+// Search from pageNumber in the given direction until a page with hits is
+// found or maxPages pages have been searched. Returns { results, next }:
+// the pages with hits, with the number of hits and the boxes of their
+// quads (a hit split across lines has several), and the page to resume from
+// (null at the end of the document). Pages in the cache reuse their text;
+// the others are searched without being added to it, so a long search does
+// not push out the pages being viewed.
+workerMethods.searchPages = function (needle, pageNumber, direction = 1, maxPages = 50) {
+	let count = openDocument.countPages()
+	let results = []
+	for (let n = 0; n < maxPages && pageNumber >= 1 && pageNumber <= count && results.length === 0; ++n) {
+		let hits
+		let entry = pageCache.get(pageNumber)
+		if (entry) {
+			hits = searchPage(entry, needle)
+		} else {
+			let page = openDocument.loadPage(pageNumber - 1)
+			try {
+				hits = page.search(needle)
+			} finally {
+				page.destroy()
+			}
+		}
+		if (hits.length > 0)
+			results.push({ pageNumber, count: hits.length, hits: hitsToBoxes(hits) })
+		pageNumber += direction
+	}
+	let next = pageNumber >= 1 && pageNumber <= count ? pageNumber : null
+	return { results, next }
+}
+
 workerMethods.getPageAnnotations = function (pageNumber, dpi) {
-	let page = openDocument.loadPage(pageNumber - 1)
+	let page = loadPage(pageNumber).page
 
 	if (page == null) {
 		return []
@@ -188,43 +441,75 @@ workerMethods.getPageAnnotations = function (pageNumber, dpi) {
 	})
 }
 
-// TODO - Move this to mupdf-view
-const lastPageRender = new Map()
-
-workerMethods.drawPageAsPNG = function (pageNumber, dpi) {
+// Render the cached contents list of a page with its annotations and
+// widgets on top. Returns null if the cookie was aborted.
+function drawPage(pageNumber, dpi, samples, cookie) {
 	const doc_to_screen = mupdf.Matrix.scale(dpi / 72, dpi / 72)
 
-	// TODO - use canvas?
-
-	let page = openDocument.loadPage(pageNumber - 1)
-	let pixmap = page.toPixmap(doc_to_screen, mupdf.DeviceRGB, false)
-
-	let png = pixmap?.saveAsPNG()
+	let entry = loadPage(pageNumber)
+	let list = loadDisplayList(entry, cookie)
+	if (list == null)
+		return null
 
-	pixmap?.destroy()
-
-	return png
+	let pixmap = null
+	let device = null
+	try {
+		let bbox = Rect.transform(entry.page.getBounds(), doc_to_screen)
+		pixmap = new mupdf.Pixmap(mupdf.ColorSpace.DeviceRGB, bbox, true, samples)
+		pixmap.clear(255)
+
+		device = new mupdf.DrawDevice(doc_to_screen, pixmap)
+		list.run(device, Matrix.identity, cookie)
+		entry.page.runPageAnnots(device, Matrix.identity, cookie)
+		entry.page.runPageWidgets(device, Matrix.identity, cookie)
+		device.close()
+
+		if (cookie?.isAborted())
+			return null
+		let result = pixmap
+		pixmap = null
+		return result
+	} finally {
+		device?.destroy()
+		pixmap?.destroy()
+		if (list !== entry.list)
+			list.destroy()
+	}
 }
 
-workerMethods.drawPageAsPixmap = function (pageNumber, dpi) {
-	const doc_to_screen = mupdf.Matrix.scale(dpi / 72, dpi / 72)
-
-	let page = openDocument.loadPage(pageNumber - 1)
-	let bbox = Rect.transform(page.getBounds(), doc_to_screen)
-	let pixmap = new mupdf.Pixmap(mupdf.DeviceRGB, bbox, true)
-	pixmap.clear(255)
-
-	let device = new mupdf.DrawDevice(doc_to_screen, pixmap)
-	page.run(device, Matrix.identity)
-	device.close()
+workerMethods.drawPageAsPNG = function (pageNumber, dpi) {
+	let pixmap = drawPage(pageNumber, dpi, null, null)
+	try {
+		return pixmap.asPNG()
+	} finally {
+		pixmap.destroy()
+	}
+}
 
-	let pixArray = pixmap.getPixels()
-	let pixW = pixmap.getWidth()
-	let pixH = pixmap.getHeight()
+// Pages are rendered into one reused block of wasm memory.
+let renderSamples = null
 
-	let imageData = new ImageData(pixArray.slice(), pixW, pixH)
+// Returns { width, height, data } where data is a Uint8ClampedArray of RGBA
+// pixels in its own buffer, which is transferred rather than copied.
+workerMethods.drawPageAsPixmap = function (pageNumber, dpi) {
+	if (!renderSamples)
+		renderSamples = new mupdf.SampleBuffer()
 
-	pixmap.destroy()
+	let cookie = newCookie()
+	let pixmap = null
+	try {
+		pixmap = drawPage(pageNumber, dpi, renderSamples, cookie)
+		if (pixmap == null)
+			return null
 
-	return imageData
+		// The one copy out of the wasm heap; postMessage then moves it.
+		return {
+			width: pixmap.getWidth(),
+			height: pixmap.getHeight(),
+			data: new Uint8ClampedArray(pixmap.getPixels()),
+		}
+	} finally {
+		pixmap?.destroy()
+		cookie.destroy()
+	}
 }
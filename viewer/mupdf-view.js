@@ -24,70 +24,403 @@
 
 var mupdfView = {}
 
-const worker = new Worker("mupdf-view-worker.js")
-const messagePromises = new Map()
+// Every worker opens its own copy of the document, but a document loaded
+// progressively is fetched only once, here, for all of them. Requests wait in a
+// priority queue on the main thread and each worker gets one at a time, so
+// that the queue can still be reordered and stale requests dropped.
+//
+// Requests that change the document state go to every worker first. Page
+// requests are ordered by the distance of the page from the viewport (see
+// setPagePriorities), then prefer the worker that last handled the same page
+// (so it can reuse what it has loaded), then come in order of arrival.
+
+const workerCount = Math.max(1, Math.min(navigator.hardwareConcurrency || 1, 4))
+
+// Methods that change the state of the document are sent to every worker.
+const broadcastMethods = new Set([
+	"setLogFilters",
+	"openStreamFromUrl",
+	"openDocumentFromBuffer",
+	"openDocumentFromStream",
+	"freeDocument",
+	"setPageCacheSize",
+	"invalidatePage",
+	"trimMemory",
+])
+
+const workers = []
+const jobQueue = []
+const jobs = new Map()
+const pageAffinity = new Map()
+let pagePriorities = new Map()
 let lastPromiseId = 0
 
-mupdfView.ready = new Promise((resolve, reject) => {
-	worker.onmessage = function (event) {
-		let type = event.data[0]
-		if (type === "READY") {
-			mupdfView.wasmMemory = event.data[1]
-			let methodNames = event.data[2]
-			for (let method of methodNames)
-				mupdfView[method] = wrap(method)
-			worker.onmessage = onWorkerMessage
-			resolve()
-		} else if (type === "ERROR") {
-			let error = event.data[1]
-			reject(new Error(error))
-		} else {
-			reject(new Error(`Unexpected first message: ${event.data}`))
+// Compile the library once, while it downloads, and share the module with
+// every worker instead of having each of them compile it. Servers that do not
+// send the application/wasm type need the slower fallback.
+function compileLibrary() {
+	let url = globalThis.crossOriginIsolated ? "../dist/mupdf-wasm-mt.wasm" : "../dist/mupdf-wasm.wasm"
+	return WebAssembly.compileStreaming(fetch(url)).catch(async () => {
+		let response = await fetch(url)
+		return WebAssembly.compile(await response.arrayBuffer())
+	})
+}
+
+function startWorker(wasmModule) {
+	return new Promise((resolve, reject) => {
+		const worker = new Worker("mupdf-view-worker.js")
+		worker.job = null
+		worker.onmessage = function (event) {
+			let type = event.data[0]
+			if (type === "READY") {
+				worker.onmessage = (event) => onWorkerMessage(worker, event)
+				resolve({ worker, memory: event.data[1], methodNames: event.data[2], textConstants: event.data[3] })
+			} else if (type === "ERROR") {
+				let error = event.data[1]
+				reject(new Error(error))
+			} else {
+				reject(new Error(`Unexpected first message: ${event.data}`))
+			}
 		}
-	}
-})
+		worker.postMessage([ "INIT", wasmModule ])
+	})
+}
+
+mupdfView.ready = (async function () {
+	let wasmModule = await compileLibrary()
+	let started = []
+	for (let i = 0; i < workerCount; ++i)
+		started.push(startWorker(wasmModule))
+	started = await Promise.all(started)
+	for (let { worker } of started)
+		workers.push(worker)
+	mupdfView.wasmMemory = started[0].memory
+	mupdfView.StructuredText = started[0].textConstants
+	for (let method of started[0].methodNames)
+		if (!mupdfView[method])
+			mupdfView[method] = wrap(method)
+})()
 
-function onWorkerMessage(event) {
+function onWorkerMessage(worker, event) {
 	let [ type, id, result ] = event.data
-	if (type === "RESULT")
-		messagePromises.get(id).resolve(result)
-	else if (type === "READY")
-		messagePromises.get(id).reject(new Error("Unexpected READY message"))
-	else if (type === "ERROR") {
-		let error = new Error(result.message)
-		error.name = result.name
-		error.stack = result.stack
-		messagePromises.get(id).reject(error)
-	} else
-		messagePromises.get(id).reject(new Error(`Unexpected result type '${type}'`))
-
-	messagePromises.delete(id)
-}
-
-// TODO - Add cancelation for trylater queues
+
+	if (type === "FETCH") {
+		let [ offset, length ] = result
+		relayRead(worker, offset, length).then(
+			(data) => worker.postMessage([ "FETCHED", id, [ data ] ], [ data.buffer ]),
+			(error) => worker.postMessage([ "FETCHED", id, [ null, error.message ] ])
+		)
+		return
+	}
+
+	if (type === "COOKIE") {
+		// The worker can abort this request while it runs.
+		if (worker.job?.id === id) {
+			worker.job.abortHandle = result
+			if (worker.job.cancelled)
+				abortJob(worker.job)
+		}
+		return
+	}
+
+	let job = jobs.get(id)
+	jobs.delete(id)
+
+	// A cancelled job has already been resolved.
+	if (job && !job.cancelled) {
+		if (type === "RESULT")
+			job.resolve(result)
+		else if (type === "READY")
+			job.reject(new Error("Unexpected READY message"))
+		else if (type === "ERROR") {
+			let error = new Error(result.message)
+			error.name = result.name
+			error.stack = result.stack
+			job.reject(error)
+		} else
+			job.reject(new Error(`Unexpected result type '${type}'`))
+	}
+
+	if (worker.job?.id === id) {
+		worker.job = null
+		schedule()
+	}
+}
+
+function jobPriority(job) {
+	if (job.worker)
+		return -1
+	if (job.pageNumber === undefined)
+		return Infinity
+	return pagePriorities.get(job.pageNumber) ?? Infinity
+}
+
+function compareJobs(a, b, worker) {
+	let pa = jobPriority(a)
+	let pb = jobPriority(b)
+	if (pa !== pb)
+		return pa < pb ? -1 : 1
+	let aa = pageAffinity.get(a.pageNumber) === worker ? 0 : 1
+	let ab = pageAffinity.get(b.pageNumber) === worker ? 0 : 1
+	if (aa !== ab)
+		return aa - ab
+	return a.id - b.id
+}
+
+function takeJob(worker) {
+	let best = -1
+	for (let i = 0; i < jobQueue.length; ++i) {
+		let job = jobQueue[i]
+		if (job.worker && job.worker !== worker)
+			continue
+		if (best < 0 || compareJobs(job, jobQueue[best], worker) < 0)
+			best = i
+	}
+	if (best < 0)
+		return null
+	return jobQueue.splice(best, 1)[0]
+}
+
+function schedule() {
+	for (let worker of workers) {
+		if (worker.job)
+			continue
+		let job = takeJob(worker)
+		if (!job)
+			continue
+		worker.job = job
+		if (job.pageNumber !== undefined)
+			pageAffinity.set(job.pageNumber, worker)
+		worker.postMessage([ job.func, job.id, job.args ], job.transfer)
+	}
+}
+
+function enqueue(func, args, transfer, worker) {
+	let job = null
+	let promise = new Promise(function (resolve, reject) {
+		let id = lastPromiseId++
+		let pageNumber = typeof args[0] === "number" ? args[0] : undefined
+		job = { id, func, args, transfer, pageNumber, worker, resolve, reject, cancelled: false, abortHandle: null }
+		jobs.set(id, job)
+		jobQueue.push(job)
+	})
+	promise.jobId = job.id
+	schedule()
+	return promise
+}
+
+function abortJob(job) {
+	// Without shared memory (non-threaded build) a running job cannot be
+	// interrupted; its result is dropped when it arrives.
+	if (job.abortHandle) {
+		Atomics.store(new Int32Array(job.abortHandle.buffer), job.abortHandle.index, 1)
+		job.abortHandle = null
+	}
+}
+
+// Cancelled requests resolve to null.
+function cancelJob(job) {
+	if (job.cancelled)
+		return
+	job.cancelled = true
+	job.resolve(null)
+	let ix = jobQueue.indexOf(job)
+	if (ix >= 0) {
+		jobQueue.splice(ix, 1)
+		jobs.delete(job.id)
+	} else {
+		abortJob(job)
+	}
+}
+
 function wrap(func) {
+	if (broadcastMethods.has(func)) {
+		return async function (...args) {
+			await mupdfView.ready
+			let results = workers.map((worker, i) => {
+				if (args[0] instanceof ArrayBuffer) {
+					// Each worker gets its own copy of the document data.
+					let buffer = i === workers.length - 1 ? args[0] : args[0].slice(0)
+					return enqueue(func, [ buffer, ...args.slice(1) ], [ buffer ], worker)
+				}
+				return enqueue(func, args, [], worker)
+			})
+			return (await Promise.all(results))[0]
+		}
+	}
 	return function (...args) {
-		return new Promise(function (resolve, reject) {
-			let id = lastPromiseId++
-			messagePromises.set(id, { resolve, reject })
-			if (args[0] instanceof ArrayBuffer)
-				worker.postMessage([ func, id, args ], [ args[0] ])
-			else
-				worker.postMessage([ func, id, args ])
-		})
+		return enqueue(func, args, [], null)
+	}
+}
+
+// Set the priority of requests for each page (as passed to the worker
+// methods); lower values go first. Pages not in the map go last.
+mupdfView.setPagePriorities = function (priorities) {
+	pagePriorities = new Map(priorities)
+	schedule()
+}
+
+// Cancel a request, whether it is still queued or already running.
+mupdfView.cancel = function (promise) {
+	let job = jobs.get(promise?.jobId)
+	if (job)
+		cancelJob(job)
+}
+
+// Page requests whose results are only wanted while the page is in view.
+// Others, such as the page size and mouse events, must always complete.
+const cancellableMethods = new Set([
+	"drawPageAsPixmap",
+	"drawPageAsPNG",
+	"getPageText",
+	"getPageLinks",
+	"search",
+])
+
+// Cancel the rendering, text, links and search requests for a page.
+mupdfView.cancelPage = function (pageNumber) {
+	for (let job of Array.from(jobs.values()))
+		if (job.pageNumber === pageNumber && !job.worker && cancellableMethods.has(job.func))
+			cancelJob(job)
+}
+
+// Search the document from pageNumber in the given direction, one batch of
+// pages per request, and yield { results, next } for each batch (see
+// searchPages in the worker). Stop iterating to stop the search; pass
+// 'next' as pageNumber to resume it later.
+mupdfView.searchDocument = async function* (needle, pageNumber = 1, direction = 1) {
+	while (pageNumber != null) {
+		let batch = await mupdfView.searchPages(needle, pageNumber, direction)
+		if (batch == null)
+			return
+		yield batch
+		pageNumber = batch.next
 	}
 }
 
 mupdfView.setLogFilters = wrap("setLogFilters")
 
-const wrap_openStreamFromUrl = wrap("openStreamFromUrl")
+// The workers read progressively loaded documents through the main thread
+// (see openDocumentFromUrl), which fetches each block once for all of them.
+// Blocks that a worker is already waiting for are shared with the others,
+// and recently fetched blocks are kept for the workers that need them later.
+// The first worker writes the blocks to the block store, so it is sent the
+// blocks fetched for the others too.
+const relay = {
+	url: null,
+	blockSize: 0,
+	pending: new Map(),
+	recent: new Map(),
+	recentSize: 0,
+}
+const relayCacheSize = 32 << 20
+
+function relayOpen(url, blockSize) {
+	relay.url = url
+	relay.blockSize = blockSize
+	relay.pending.clear()
+	relay.recent.clear()
+	relay.recentSize = 0
+}
+
+function relayKeep(block, data) {
+	relay.recent.set(block, data)
+	relay.recentSize += data.length
+	while (relay.recentSize > relayCacheSize) {
+		let [ oldest, old ] = relay.recent.entries().next().value
+		relay.recent.delete(oldest)
+		relay.recentSize -= old.length
+	}
+}
+
+// A server that ignores Range sends the whole file.
+async function relayFetch(url, offset, length) {
+	let response = await fetch(url, { headers: { Range: `bytes=${offset}-${offset + length - 1}` } })
+	if (!response.ok)
+		throw new Error(`HTTP ${response.status}`)
+	let data = new Uint8Array(await response.arrayBuffer())
+	if (response.status === 200)
+		data = data.slice(offset, offset + length)
+	return data
+}
+
+// Fetch blocks first to end of a read that ends at stop.
+function relayFetchBlocks(worker, first, end, stop) {
+	let { url, blockSize } = relay
+	let start = first * blockSize
+	let length = Math.min(end * blockSize, stop) - start
+	let fetched = relayFetch(url, start, length)
+	fetched.then((data) => {
+		if (relay.url === url && worker !== workers[0] && data.length === length)
+			workers[0].postMessage([ "STORE", null, [ start, data ] ])
+	}, () => {})
+	for (let block = first; block < end; ++block) {
+		let part = fetched.then((data) => data.slice((block - first) * blockSize, (block - first + 1) * blockSize))
+		relay.pending.set(block, part)
+		part.then((data) => {
+			if (relay.url === url && relay.pending.get(block) === part) {
+				relay.pending.delete(block)
+				relayKeep(block, data)
+			}
+		}, () => {
+			if (relay.pending.get(block) === part)
+				relay.pending.delete(block)
+		})
+	}
+}
+
+// Reads start at a block, as the workers read whole blocks.
+async function relayRead(worker, offset, length) {
+	let blockSize = relay.blockSize
+	let first = offset / blockSize
+	let end = Math.ceil((offset + length) / blockSize)
+	let missing = null
+	for (let block = first; block <= end; ++block) {
+		if (block < end && !relay.recent.has(block) && !relay.pending.has(block)) {
+			missing = missing ?? block
+		} else if (missing !== null) {
+			relayFetchBlocks(worker, missing, block, offset + length)
+			missing = null
+		}
+	}
+	let parts = []
+	for (let block = first; block < end; ++block)
+		parts.push(relay.recent.get(block) ?? relay.pending.get(block))
+	// A short block (at the end of the file, or of a short response) ends
+	// the data.
+	let data = new Uint8Array(length)
+	let n = 0
+	for (let part of await Promise.all(parts)) {
+		part = part.subarray(0, length - n)
+		data.set(part, n)
+		n += part.length
+		if (part.length < blockSize)
+			break
+	}
+	return data.subarray(0, n)
+}
+
 const wrap_openDocumentFromStream = wrap("openDocumentFromStream")
 
-mupdfView.openDocumentFromUrl = async function (url, contentLength, progressive, prefetch, magic) {
-	await wrap_openStreamFromUrl(url, contentLength, progressive, prefetch)
+// The first worker is the one that writes fetched blocks to the block store.
+mupdfView.openDocumentFromUrl = async function (url, contentLength, progressive, prefetch, magic, validator) {
+	await mupdfView.ready
+	if (contentLength == null || validator === undefined) {
+		let head = await fetch(url, { method: "HEAD" })
+		if (!head.ok)
+			throw new Error(`HTTP ${head.status}`)
+		contentLength = contentLength ?? Number(head.headers.get("Content-Length"))
+		validator = validator ?? head.headers.get("ETag") ?? head.headers.get("Last-Modified")
+	}
+	let blockSize = Math.max(progressive << 10, 1 << 16)
+	relayOpen(url, blockSize)
+	await Promise.all(workers.map((worker, i) => {
+		return enqueue("openStreamFromUrl", [ url, contentLength, blockSize, prefetch, validator, i === 0 ], [], worker)
+	}))
 	return await wrap_openDocumentFromStream(magic)
 }
 
 mupdfView.terminate = function () {
-	worker.terminate()
+	for (let worker of workers)
+		worker.terminate()
 }